@@ -32,6 +32,8 @@
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
+#include "fies/profiler.h"
+#include "fies/tlb-profiler.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -760,6 +762,24 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/* Attribute a softmmu slow path event to the TB that caused it.  Events
+ * without a host return address in translated code are not counted. */
+static void tlb_profile_event(TLBProfileEvent event, uintptr_t retaddr)
+{
+    target_ulong pc;
+
+    if (tb_host_pc_to_guest_pc(retaddr, &pc)) {
+        tlb_profile_record(pc, event);
+    }
+}
+
+#define TLB_PROFILE(event, retaddr)                     \
+    do {                                                \
+        if (unlikely(profile_tlb)) {                    \
+            tlb_profile_event(event, retaddr);          \
+        }                                               \
+    } while (0)
+
 static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
                          int mmu_idx,
                          target_ulong addr, uintptr_t retaddr, int size)
@@ -776,6 +796,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
         cpu_io_recompile(cpu, retaddr);
     }
+    TLB_PROFILE(TLB_PROFILE_IO, retaddr);
 
     cpu->mem_io_vaddr = addr;
 
@@ -811,6 +832,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
         cpu_io_recompile(cpu, retaddr);
     }
+    TLB_PROFILE(TLB_PROFILE_IO, retaddr);
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
 
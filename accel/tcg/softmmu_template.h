@@ -126,8 +126,11 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
     if ((addr & TARGET_PAGE_MASK)
          != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if (!VICTIM_TLB_HIT(ADDR_READ, addr)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
+        } else {
+            TLB_PROFILE(TLB_PROFILE_VICTIM_HIT, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
@@ -155,6 +158,7 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
         DATA_TYPE res1, res2;
         unsigned shift;
     do_unaligned_access:
+        TLB_PROFILE(TLB_PROFILE_UNALIGNED, retaddr);
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         res1 = helper_le_ld_name(env, addr1, oi, retaddr);
@@ -195,8 +199,11 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
     if ((addr & TARGET_PAGE_MASK)
          != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if (!VICTIM_TLB_HIT(ADDR_READ, addr)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
                      mmu_idx, retaddr);
+        } else {
+            TLB_PROFILE(TLB_PROFILE_VICTIM_HIT, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].ADDR_READ;
     }
@@ -222,6 +229,7 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
         DATA_TYPE res1, res2;
         unsigned shift;
     do_unaligned_access:
+        TLB_PROFILE(TLB_PROFILE_UNALIGNED, retaddr);
         addr1 = addr & ~(DATA_SIZE - 1);
         addr2 = addr1 + DATA_SIZE;
         res1 = helper_be_ld_name(env, addr1, oi, retaddr);
@@ -287,7 +295,10 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     if ((addr & TARGET_PAGE_MASK)
         != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        } else {
+            TLB_PROFILE(TLB_PROFILE_VICTIM_HIT, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write & ~TLB_INVALID_MASK;
     }
@@ -313,6 +324,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         int i, index2;
         target_ulong page2, tlb_addr2;
     do_unaligned_access:
+        TLB_PROFILE(TLB_PROFILE_UNALIGNED, retaddr);
         /* Ensure the second page is in the TLB.  Note that the first page
            is already guaranteed to be filled, and that the second page
            cannot evict the first.  */
@@ -321,6 +333,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         tlb_addr2 = env->tlb_table[mmu_idx][index2].addr_write;
         if (page2 != (tlb_addr2 & (TARGET_PAGE_MASK | TLB_INVALID_MASK))
             && !VICTIM_TLB_HIT(addr_write, page2)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), page2, MMU_DATA_STORE,
                      mmu_idx, retaddr);
         }
@@ -367,7 +380,10 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     if ((addr & TARGET_PAGE_MASK)
         != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        } else {
+            TLB_PROFILE(TLB_PROFILE_VICTIM_HIT, retaddr);
         }
         tlb_addr = env->tlb_table[mmu_idx][index].addr_write & ~TLB_INVALID_MASK;
     }
@@ -392,6 +408,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         int i, index2;
         target_ulong page2, tlb_addr2;
     do_unaligned_access:
+        TLB_PROFILE(TLB_PROFILE_UNALIGNED, retaddr);
         /* Ensure the second page is in the TLB.  Note that the first page
            is already guaranteed to be filled, and that the second page
            cannot evict the first.  */
@@ -400,6 +417,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
         tlb_addr2 = env->tlb_table[mmu_idx][index2].addr_write;
         if (page2 != (tlb_addr2 & (TARGET_PAGE_MASK | TLB_INVALID_MASK))
             && !VICTIM_TLB_HIT(addr_write, page2)) {
+            TLB_PROFILE(TLB_PROFILE_MISS, retaddr);
             tlb_fill(ENV_GET_CPU(env), page2, MMU_DATA_STORE,
                      mmu_idx, retaddr);
         }
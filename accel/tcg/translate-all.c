@@ -1089,16 +1089,16 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         return;
     }
 
-    /* remove the TB from the page list */
+    /* remove the TB from the page list.  A code bitmap is left with stale
+     * bits set; they only cause a false hit on the slow path, which then
+     * rebuilds the bitmap (see tb_invalidate_phys_page_range). */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     /* remove the TB from the hash list */
@@ -1120,31 +1120,43 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* Mark the bytes of page 'n' of 'tb' in the page code bitmap. */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    if (p->code_bitmap) {
+        bitmap_zero(p->code_bitmap, TARGET_PAGE_SIZE);
+    } else {
+        p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-             }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -1171,7 +1183,14 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+#ifdef CONFIG_SOFTMMU
+    /* Keep an existing code bitmap up to date rather than dropping it, so
+     * that retranslating code on a page with frequent data writes does not
+     * push those writes back onto the slow path. */
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1526,6 +1545,9 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     if (!p->first_tb) {
         invalidate_page_bitmap(p);
         tlb_unprotect_code(start);
+    } else if (p->code_bitmap) {
+        /* drop the bits of the TBs we just removed (and any stale ones) */
+        build_page_bitmap(p);
     }
 #endif
 #ifdef TARGET_HAS_PRECISE_SMC
@@ -1671,6 +1693,42 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     return g_tree_lookup(tb_ctx.tb_tree, &s);
 }
 
+bool tb_host_pc_to_guest_pc(uintptr_t host_pc, target_ulong *pc)
+{
+    /* Consecutive lookups mostly hit the same TB; cache the last one per
+     * thread so that only the first lookup needs tb_lock.  The cache is
+     * valid until the code buffer is flushed.
+     */
+    static __thread uintptr_t cached_start, cached_end;
+    static __thread target_ulong cached_pc;
+    static __thread unsigned cached_flush_count;
+    unsigned flush_count = atomic_read(&tb_ctx.tb_flush_count);
+    TranslationBlock *tb;
+
+    if (host_pc - (uintptr_t)tcg_init_ctx.code_gen_buffer
+        >= tcg_init_ctx.code_gen_buffer_size) {
+        return false;
+    }
+    if (flush_count == cached_flush_count &&
+        host_pc >= cached_start && host_pc < cached_end) {
+        *pc = cached_pc;
+        return true;
+    }
+
+    tb_lock();
+    tb = tb_find_pc(host_pc);
+    if (tb) {
+        cached_start = (uintptr_t)tb->tc.ptr;
+        cached_end = cached_start + tb->tc.size;
+        cached_pc = tb->pc;
+        cached_flush_count = flush_count;
+        *pc = tb->pc;
+    }
+    tb_unlock();
+
+    return tb != NULL;
+}
+
 #if !defined(CONFIG_USER_ONLY)
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
 {
@@ -849,6 +849,7 @@ static void bdrv_temp_snapshot_options(int *child_flags, QDict *child_options,
     /* aio=native doesn't work for cache.direct=off, so disable it for the
      * temporary snapshot */
     *child_flags &= ~BDRV_O_NATIVE_AIO;
+    *child_flags &= ~BDRV_O_IO_URING;
 }
 
 /*
@@ -4009,6 +4010,36 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/*
+ * Returns a host file descriptor that @bytes of data at @offset can be read
+ * from without going through the block layer, and the offset of the data in
+ * that file in *@host_offset; or -errno if there is no such descriptor.
+ *
+ * Filters are not passed through: throttling, blkdebug, replication and the
+ * like must see every request, so only drivers that implement the callback
+ * themselves can hand out a descriptor.
+ *
+ * The descriptor is owned by the driver and may be closed as soon as the
+ * caller yields, so it must be duplicated if it is needed for longer.
+ */
+int bdrv_get_read_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int64_t *host_offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    /* Copy-on-read needs to see the request */
+    if (atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+    if (!drv->bdrv_get_read_fd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_read_fd(bs, offset, bytes, host_offset);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -53,6 +53,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -94,6 +95,28 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (!hist->bins) {
+        return;
+    }
+
+    /* Find the first boundary above the latency, its index is the bin */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -125,6 +148,14 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         }
     }
 
+    /* Failed requests did not really complete, so only successful ones
+     * go to the histogram.  This is done under the lock that is already
+     * taken here, so the histogram does not add any synchronisation cost. */
+    if (!failed) {
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
+    }
+
     qemu_mutex_unlock(&stats->lock);
 }
 
@@ -183,3 +214,92 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+/*
+ * Enable the latency histogram for @type with the given (strictly
+ * ascending, non-zero) bin boundaries in nanoseconds, or reset it if it is
+ * already enabled.  Returns -EINVAL if @boundaries is not ascending.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    uint64List *entry;
+    uint64_t prev = 0;
+    int nbins = 1;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return -EINVAL;
+        }
+        prev = entry->value;
+        nbins++;
+    }
+
+    qemu_mutex_lock(&stats->lock);
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+
+    hist->nbins = nbins;
+    hist->boundaries = g_new(uint64_t, nbins - 1);
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        hist->boundaries[i] = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, nbins);
+    qemu_mutex_unlock(&stats->lock);
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    qemu_mutex_lock(&stats->lock);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        g_free(hist->boundaries);
+        g_free(hist->bins);
+        memset(hist, 0, sizeof(*hist));
+    }
+    qemu_mutex_unlock(&stats->lock);
+}
+
+/* Returns a snapshot of the histogram for @type, or NULL if it is disabled */
+BlockLatencyHistogramInfo *
+block_latency_histogram_info(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    BlockLatencyHistogramInfo *info = NULL;
+    uint64List **next;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    if (!hist->bins) {
+        goto out;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    next = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *next = g_new0(uint64List, 1);
+        (*next)->value = hist->boundaries[i];
+        next = &(*next)->next;
+    }
+    next = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *next = g_new0(uint64List, 1);
+        (*next)->value = hist->bins[i];
+        next = &(*next)->next;
+    }
+
+out:
+    qemu_mutex_unlock(&stats->lock);
+    return info;
+}
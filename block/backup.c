@@ -43,6 +43,8 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    /* Cleared once the first copy offload attempt turns out unsupported */
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -118,6 +120,20 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 
         n = MIN(job->cluster_size, job->common.len - start);
 
+        if (job->use_copy_range) {
+            ret = blk_co_copy_range(blk, start, job->target, start, n,
+                                    is_write_notifier ?
+                                    BDRV_REQ_NO_SERIALISING : 0, 0);
+            if (ret >= 0) {
+                goto copied;
+            }
+            trace_backup_do_cow_copy_range_fail(job, start, ret);
+            if (ret == -ENOTSUP) {
+                job->use_copy_range = false;
+            }
+            /* Retry through the bounce buffer to get proper error reporting */
+        }
+
         if (!bounce_buffer) {
             bounce_buffer = blk_blockalign(blk, job->cluster_size);
         }
@@ -151,6 +167,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
             goto out;
         }
 
+copied:
         set_bit(start / job->cluster_size, job->done_bitmap);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
@@ -631,6 +648,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
@@ -1137,6 +1137,40 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
     return ret;
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   unsigned int bytes,
+                                   BdrvRequestFlags read_flags,
+                                   BdrvRequestFlags write_flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Throttled requests must go through the normal path to be accounted */
+    if (blk_in->public.throttle_group_member.throttle_state ||
+        blk_out->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(blk_bs(blk_out));
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, read_flags, write_flags);
+    /* Drivers do not implement BDRV_REQ_FUA for copies */
+    if (ret == 0 && !blk_out->enable_write_cache) {
+        ret = bdrv_co_flush(blk_bs(blk_out));
+    }
+    bdrv_dec_in_flight(blk_bs(blk_out));
+    return ret;
+}
+
 typedef struct BlkRwCo {
     BlockBackend *blk;
     int64_t offset;
@@ -1345,6 +1379,40 @@ int blk_pread(BlockBackend *blk, int64_t offset, void *buf, int count)
     return count;
 }
 
+/*
+ * Returns a host file descriptor that @bytes at @offset can be read from
+ * directly, see bdrv_get_read_fd().  Returns -ENOTSUP if reads must go through
+ * blk_pread() and friends, e.g. because I/O limits apply.
+ */
+int blk_get_read_fd(BlockBackend *blk, int64_t offset, int bytes,
+                    int64_t *host_offset)
+{
+    int ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (blk->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_get_read_fd(blk_bs(blk), offset, bytes, host_offset);
+}
+
+/*
+ * Accounts for I/O on the root node that is done outside of the block layer,
+ * e.g. on a descriptor from blk_get_read_fd(), so that draining waits for it.
+ */
+void blk_inc_in_flight(BlockBackend *blk)
+{
+    bdrv_inc_in_flight(blk_bs(blk));
+}
+
+void blk_dec_in_flight(BlockBackend *blk)
+{
+    bdrv_dec_in_flight(blk_bs(blk));
+}
+
 int blk_pwrite(BlockBackend *blk, int64_t offset, const void *buf, int count,
                BdrvRequestFlags flags)
 {
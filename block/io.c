@@ -1407,6 +1407,158 @@ fail:
     return ret;
 }
 
+/*
+ * Write @bytes bytes of @qiov, starting at @qiov_offset, in pieces of at
+ * most @max_transfer bytes.
+ */
+static int coroutine_fn bdrv_driver_pwritev_split(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    size_t qiov_offset, int max_transfer, int flags)
+{
+    uint64_t bytes_remaining = bytes;
+    int ret = 0;
+
+    bdrv_debug_event(bs, BLKDBG_PWRITEV);
+    if (qiov_offset == 0 && bytes == qiov->size && bytes <= max_transfer) {
+        return bdrv_driver_pwritev(bs, offset, bytes, qiov, flags);
+    }
+
+    while (bytes_remaining) {
+        int num = MIN(bytes_remaining, max_transfer);
+        QEMUIOVector local_qiov;
+        int local_flags = flags;
+
+        assert(num);
+        if (num < bytes_remaining && (flags & BDRV_REQ_FUA) &&
+            !(bs->supported_write_flags & BDRV_REQ_FUA)) {
+            /* If FUA is going to be emulated by flush, we only
+             * need to flush on the last iteration */
+            local_flags &= ~BDRV_REQ_FUA;
+        }
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov,
+                          qiov_offset + bytes - bytes_remaining, num);
+
+        ret = bdrv_driver_pwritev(bs, offset + bytes - bytes_remaining,
+                                  num, &local_qiov, local_flags);
+        qemu_iovec_destroy(&local_qiov);
+        if (ret < 0) {
+            break;
+        }
+        bytes_remaining -= num;
+    }
+
+    return ret;
+}
+
+/* Smallest zeroed range inside a write that detect-zeroes turns into a zero
+ * write, unless the driver zeroes larger units anyway */
+#define DETECT_ZEROES_MIN_GRANULARITY 4096
+
+/* Smallest zeroed range that is split off a write on a protocol node, where
+ * each piece costs a separate system call or network round trip and small
+ * holes only fragment the file */
+#define DETECT_ZEROES_MIN_PROTOCOL_EXTENT (64 * 1024)
+
+static bool bdrv_zero_cluster_at(QEMUIOVector *qiov, int64_t offset,
+                                 int64_t pos, int64_t granularity)
+{
+    return qemu_iovec_is_zero_range(qiov, pos - offset, granularity);
+}
+
+/*
+ * With detect-zeroes, turn runs of zeroed clusters inside a write that is
+ * not zero as a whole into zero writes.  Formats can usually zero clusters
+ * by only updating metadata, and protocols can punch holes, so this saves
+ * both space in the image and write bandwidth.
+ *
+ * Returns -ENOTSUP without writing anything if no zeroed run of aligned
+ * clusters in the request is long enough.
+ *
+ * If FUA is emulated by a flush, only the last piece needs it: the flush
+ * also covers the pieces written before.
+ */
+static int coroutine_fn bdrv_co_pwritev_zero_extents(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    int max_transfer, int flags)
+{
+    int64_t granularity = QEMU_ALIGN_UP(MAX(bs->bl.pwrite_zeroes_alignment,
+                                            DETECT_ZEROES_MIN_GRANULARITY),
+                                        bs->bl.request_alignment);
+    int64_t min_extent = granularity;
+    int64_t end = offset + bytes;
+    int64_t data_start = offset;
+    int64_t pos, zero_end;
+    int piece_flags = flags;
+    int zero_flags = BDRV_REQ_ZERO_WRITE;
+    int fua, ret;
+
+    if (!((bs->supported_write_flags | bs->supported_zero_flags) &
+          BDRV_REQ_FUA)) {
+        piece_flags &= ~BDRV_REQ_FUA;
+    }
+    if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
+        zero_flags |= BDRV_REQ_MAY_UNMAP;
+    }
+    if (bs->drv->bdrv_file_open) {
+        min_extent = QEMU_ALIGN_UP(MAX(granularity,
+                                       DETECT_ZEROES_MIN_PROTOCOL_EXTENT),
+                                   granularity);
+    }
+
+    pos = QEMU_ALIGN_UP(offset, granularity);
+    for (;;) {
+        while (pos + granularity <= end &&
+               !bdrv_zero_cluster_at(qiov, offset, pos, granularity)) {
+            pos += granularity;
+        }
+        if (pos + granularity > end) {
+            break;
+        }
+
+        /* pos is the start of a zero cluster here */
+        zero_end = pos + granularity;
+        while (zero_end + granularity <= end &&
+               bdrv_zero_cluster_at(qiov, offset, zero_end, granularity)) {
+            zero_end += granularity;
+        }
+        if (zero_end - pos < min_extent) {
+            /* Too short to be worth a separate request, keep it as data */
+            pos = zero_end;
+            continue;
+        }
+
+        if (pos > data_start) {
+            ret = bdrv_driver_pwritev_split(bs, data_start, pos - data_start,
+                                            qiov, data_start - offset,
+                                            max_transfer, piece_flags);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        fua = (zero_end == end ? flags : piece_flags) & BDRV_REQ_FUA;
+        bdrv_debug_event(bs, BLKDBG_PWRITEV_ZERO);
+        ret = bdrv_co_do_pwrite_zeroes(bs, pos, zero_end - pos,
+                                       zero_flags | fua);
+        if (ret < 0) {
+            return ret;
+        }
+        data_start = zero_end;
+        pos = zero_end;
+    }
+
+    if (data_start == offset) {
+        return -ENOTSUP;
+    }
+    if (data_start < end) {
+        return bdrv_driver_pwritev_split(bs, data_start, end - data_start,
+                                         qiov, data_start - offset,
+                                         max_transfer, flags);
+    }
+    return 0;
+}
+
 /*
  * Forwards an already correctly aligned write request to the BlockDriver,
  * after possibly fragmenting it.
@@ -1421,7 +1573,6 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
     int ret;
 
     int64_t end_sector = DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE);
-    uint64_t bytes_remaining = bytes;
     int max_transfer;
 
     if (!drv) {
@@ -1466,33 +1617,16 @@ static int coroutine_fn bdrv_aligned_pwritev(BdrvChild *child,
         ret = bdrv_co_do_pwrite_zeroes(bs, offset, bytes, flags);
     } else if (flags & BDRV_REQ_WRITE_COMPRESSED) {
         ret = bdrv_driver_pwritev_compressed(bs, offset, bytes, qiov);
-    } else if (bytes <= max_transfer) {
-        bdrv_debug_event(bs, BLKDBG_PWRITEV);
-        ret = bdrv_driver_pwritev(bs, offset, bytes, qiov, flags);
     } else {
-        bdrv_debug_event(bs, BLKDBG_PWRITEV);
-        while (bytes_remaining) {
-            int num = MIN(bytes_remaining, max_transfer);
-            QEMUIOVector local_qiov;
-            int local_flags = flags;
-
-            assert(num);
-            if (num < bytes_remaining && (flags & BDRV_REQ_FUA) &&
-                !(bs->supported_write_flags & BDRV_REQ_FUA)) {
-                /* If FUA is going to be emulated by flush, we only
-                 * need to flush on the last iteration */
-                local_flags &= ~BDRV_REQ_FUA;
-            }
-            qemu_iovec_init(&local_qiov, qiov->niov);
-            qemu_iovec_concat(&local_qiov, qiov, bytes - bytes_remaining, num);
-
-            ret = bdrv_driver_pwritev(bs, offset + bytes - bytes_remaining,
-                                      num, &local_qiov, local_flags);
-            qemu_iovec_destroy(&local_qiov);
-            if (ret < 0) {
-                break;
-            }
-            bytes_remaining -= num;
+        ret = -ENOTSUP;
+        if (bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
+            drv->bdrv_co_pwrite_zeroes) {
+            ret = bdrv_co_pwritev_zero_extents(bs, offset, bytes, qiov,
+                                               max_transfer, flags);
+        }
+        if (ret == -ENOTSUP) {
+            ret = bdrv_driver_pwritev_split(bs, offset, bytes, qiov, 0,
+                                            max_transfer, flags);
         }
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
@@ -1767,6 +1901,133 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn
+bdrv_co_copy_range_internal(BdrvChild *src, int64_t src_offset,
+                            BdrvChild *dst, int64_t dst_offset,
+                            unsigned int bytes, BdrvRequestFlags read_flags,
+                            BdrvRequestFlags write_flags, bool recurse_src)
+{
+    BlockDriverState *bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    bs = dst->bs;
+    if (bs->read_only) {
+        return -EPERM;
+    }
+    ret = bdrv_check_byte_request(bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    if (write_flags & BDRV_REQ_ZERO_WRITE) {
+        return bdrv_co_pwrite_zeroes(dst, dst_offset, bytes, write_flags);
+    }
+
+    if (!src || !src->bs || !src->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(src->bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Unaligned requests would need a read-modify-write cycle, which is
+     * what the caller's fallback does anyway */
+    if (!src->bs->drv->bdrv_co_copy_range_from ||
+        !bs->drv->bdrv_co_copy_range_to ||
+        !QEMU_IS_ALIGNED(src_offset | bytes, src->bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bs = src->bs;
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, src_offset, bytes, BDRV_TRACKED_READ);
+        if (!(read_flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset, dst,
+                                               dst_offset, bytes,
+                                               read_flags, write_flags);
+
+        tracked_request_end(&req);
+        bdrv_dec_in_flight(bs);
+        return ret;
+    }
+
+    /* This mirrors bdrv_aligned_pwritev() for the data written to @dst */
+    if (bdrv_has_readonly_bitmaps(bs)) {
+        return -EPERM;
+    }
+    assert(!(bs->open_flags & BDRV_O_INACTIVE));
+    assert(dst->perm & BLK_PERM_WRITE);
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, dst_offset, bytes, BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+
+    ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+    if (ret == 0) {
+        ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset, dst,
+                                             dst_offset, bytes,
+                                             read_flags, write_flags);
+    }
+
+    atomic_inc(&bs->write_gen);
+    bdrv_set_dirty(bs, dst_offset, bytes);
+    stat64_max(&bs->wr_highest_offset, dst_offset + bytes);
+    if (ret >= 0) {
+        bs->total_sectors = MAX(bs->total_sectors,
+                                DIV_ROUND_UP(dst_offset + bytes,
+                                             BDRV_SECTOR_SIZE));
+        ret = 0;
+    }
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* For drivers: continue a copy on the source and destination side */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
+                                         BdrvChild *dst, int64_t dst_offset,
+                                         unsigned int bytes,
+                                         BdrvRequestFlags read_flags,
+                                         BdrvRequestFlags write_flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  read_flags, write_flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, read_flags, write_flags, true);
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, int64_t src_offset,
+                                       BdrvChild *dst, int64_t dst_offset,
+                                       unsigned int bytes,
+                                       BdrvRequestFlags read_flags,
+                                       BdrvRequestFlags write_flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                read_flags, write_flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, read_flags, write_flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
+                                    BdrvChild *dst, int64_t dst_offset,
+                                    unsigned int bytes,
+                                    BdrvRequestFlags read_flags,
+                                    BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
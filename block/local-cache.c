@@ -0,0 +1,1431 @@
+/*
+ * Persistent local cache block driver
+ *
+ * Keeps the recently used blocks of a slow image (on NFS, ssh, http, ...) in
+ * a cache file on local storage, so that repeated runs from the same image
+ * are served locally.  The cache file survives across runs:
+ *
+ *   0              LocalCacheHeader (big endian)
+ *   index_offset   one LocalCacheEntry for each slot (big endian)
+ *   data_offset    block_size bytes of data for each slot
+ *
+ * The header records which image the cache file belongs to (by filename),
+ * the image size and the cache geometry; a cache file that does not match
+ * them is emptied when it is opened.
+ *
+ * The index is kept in memory and written to the cache file at checkpoints:
+ * on guest flushes in write-back mode and when the node is closed.  While
+ * the cache file is in use, LOCAL_CACHE_F_IN_USE is set in its header.  If
+ * the flag is still set when the cache file is opened, QEMU did not close
+ * it: after write-through use it is simply emptied, after write-back use
+ * all blocks in it are written back to the image first.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/util.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/option.h"
+#include "block/block_int.h"
+#include "crypto/hash.h"
+#include "trace.h"
+
+#define LOCAL_CACHE_MAGIC               0x514c434143484500ULL /* QLCACHE\0 */
+#define LOCAL_CACHE_VERSION             1
+#define LOCAL_CACHE_HEADER_SIZE         4096
+#define LOCAL_CACHE_INDEX_PAGE          4096
+
+#define LOCAL_CACHE_F_IN_USE            (1 << 0)
+#define LOCAL_CACHE_F_WRITEBACK         (1 << 1)
+
+#define LOCAL_CACHE_ENTRY_DIRTY         (1 << 0)
+
+#define LOCAL_CACHE_IMAGE_ID_SIZE       32
+
+#define LOCAL_CACHE_DEFAULT_SIZE        (1ULL << 30)
+#define LOCAL_CACHE_DEFAULT_BLOCK_SIZE  (64 * 1024)
+#define LOCAL_CACHE_MIN_BLOCK_SIZE      4096
+#define LOCAL_CACHE_MAX_BLOCK_SIZE      (2 * 1024 * 1024)
+#define LOCAL_CACHE_MAX_SLOTS           (16 * 1024 * 1024)
+
+/* Largest run of missing blocks that is read from the image at once */
+#define LOCAL_CACHE_MAX_FILL_BYTES      (1024 * 1024)
+#define LOCAL_CACHE_MAX_FILL_BLOCKS     16
+
+#define LOCAL_CACHE_OPT_CACHE_SIZE      "cache-size"
+#define LOCAL_CACHE_OPT_BLOCK_SIZE      "block-size"
+#define LOCAL_CACHE_OPT_MODE            "mode"
+
+typedef struct QEMU_PACKED LocalCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint8_t image_id[LOCAL_CACHE_IMAGE_ID_SIZE];  /* SHA-256 of filename */
+} LocalCacheHeader;
+
+typedef struct QEMU_PACKED LocalCacheEntry {
+    uint64_t block;             /* image block number + 1, or 0 if unused */
+    uint64_t flags;             /* LOCAL_CACHE_ENTRY_* */
+} LocalCacheEntry;
+
+#define LOCAL_CACHE_ENTRIES_PER_PAGE \
+    (LOCAL_CACHE_INDEX_PAGE / sizeof(LocalCacheEntry))
+
+typedef enum LocalCacheSlotState {
+    LOCAL_CACHE_SLOT_FREE,      /* on free_list or pending_list */
+    LOCAL_CACHE_SLOT_BUSY,      /* being filled or written back */
+    LOCAL_CACHE_SLOT_VALID,     /* on lru, unless stale */
+} LocalCacheSlotState;
+
+typedef struct LocalCacheSlot {
+    uint64_t block;             /* image block number, unless FREE */
+    LocalCacheSlotState state;
+    bool dirty;                 /* newer than the image (write-back mode) */
+
+    /* Removed from the lookup table by a write; the slot is freed once
+     * the requests that use it are done */
+    bool stale;
+
+    unsigned users;             /* requests accessing the slot data */
+    CoQueue wait_queue;         /* requests waiting for a BUSY slot */
+    QTAILQ_ENTRY(LocalCacheSlot) next;
+} LocalCacheSlot;
+
+typedef struct BDRVLocalCacheState {
+    BdrvChild *cache_file;
+    LocalCacheMode mode;
+    uint32_t block_size;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t data_offset;
+    int64_t image_size;
+    uint8_t image_id[LOCAL_CACHE_IMAGE_ID_SIZE];
+    unsigned max_fill_blocks;
+
+    LocalCacheSlot *slots;
+    GHashTable *blocks;         /* image block number -> BUSY or VALID slot */
+    QTAILQ_HEAD(, LocalCacheSlot) lru;  /* VALID slots, least recent first */
+    QTAILQ_HEAD(, LocalCacheSlot) free_list;
+    uint64_t nb_dirty;
+
+    /* Free slots that the index on disk still refers to.  In write-back
+     * mode they can only be reused after the next checkpoint. */
+    QTAILQ_HEAD(, LocalCacheSlot) pending_list;
+
+    /* Requests waiting for a slot to become free */
+    CoQueue free_queue;
+
+    /* The index as it is written at the next checkpoint, the pages of it
+     * that changed and the slots that are valid in the index on disk */
+    LocalCacheEntry *index;
+    unsigned long *index_dirty;
+    unsigned long *on_disk;
+
+    /* Set when blocks were written back since the last checkpoint */
+    bool image_flush_needed;
+    CoMutex checkpoint_lock;
+} BDRVLocalCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "local-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = LOCAL_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data in bytes",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the blocks that are cached, in bytes",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "Cache mode (writethrough, writeback)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint64_t local_cache_slot_index(BDRVLocalCacheState *s,
+                                              LocalCacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+static inline int64_t local_cache_slot_offset(BDRVLocalCacheState *s,
+                                              LocalCacheSlot *slot)
+{
+    return s->data_offset + local_cache_slot_index(s, slot) * s->block_size;
+}
+
+/* Number of bytes of the image that are in @block */
+static inline uint64_t local_cache_block_bytes(BDRVLocalCacheState *s,
+                                               uint64_t block)
+{
+    return MIN(s->block_size, s->image_size - block * s->block_size);
+}
+
+static void local_cache_update_entry(BDRVLocalCacheState *s,
+                                     LocalCacheSlot *slot)
+{
+    uint64_t i = local_cache_slot_index(s, slot);
+    bool valid = slot->state == LOCAL_CACHE_SLOT_VALID && !slot->stale;
+
+    s->index[i].block = cpu_to_be64(valid ? slot->block + 1 : 0);
+    s->index[i].flags = cpu_to_be64(valid && slot->dirty ?
+                                    LOCAL_CACHE_ENTRY_DIRTY : 0);
+    set_bit(i / LOCAL_CACHE_ENTRIES_PER_PAGE, s->index_dirty);
+}
+
+static void local_cache_set_dirty(BDRVLocalCacheState *s,
+                                  LocalCacheSlot *slot, bool dirty)
+{
+    if (slot->dirty != dirty) {
+        slot->dirty = dirty;
+        s->nb_dirty += dirty ? 1 : -1;
+        local_cache_update_entry(s, slot);
+    }
+}
+
+/* Put a slot that is neither in the lookup table nor used any more on the
+ * free list */
+static void local_cache_free_slot(BDRVLocalCacheState *s,
+                                  LocalCacheSlot *slot)
+{
+    assert(!slot->users);
+
+    local_cache_set_dirty(s, slot, false);
+    slot->state = LOCAL_CACHE_SLOT_FREE;
+    slot->stale = false;
+    local_cache_update_entry(s, slot);
+
+    /* After a crash in write-back mode, every block in the index on disk
+     * is written back to the image, so the slot data must stay what the
+     * index says it is */
+    if (s->mode == LOCAL_CACHE_MODE_WRITEBACK &&
+        test_bit(local_cache_slot_index(s, slot), s->on_disk)) {
+        QTAILQ_INSERT_TAIL(&s->pending_list, slot, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&s->free_list, slot, next);
+    }
+
+    qemu_co_queue_restart_all(&slot->wait_queue);
+    qemu_co_queue_restart_all(&s->free_queue);
+}
+
+/* Finish filling a BUSY slot.  It becomes VALID if @valid is true and no
+ * write made the data stale in the meantime, otherwise it is freed. */
+static void local_cache_slot_ready(BDRVLocalCacheState *s,
+                                   LocalCacheSlot *slot, bool valid)
+{
+    assert(slot->state == LOCAL_CACHE_SLOT_BUSY);
+
+    if (!valid || slot->stale) {
+        if (!slot->stale) {
+            g_hash_table_remove(s->blocks, &slot->block);
+        }
+        local_cache_free_slot(s, slot);
+        return;
+    }
+
+    slot->state = LOCAL_CACHE_SLOT_VALID;
+    QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    local_cache_update_entry(s, slot);
+    qemu_co_queue_restart_all(&slot->wait_queue);
+}
+
+/* Remove a slot from the lookup table, so that requests do not find the
+ * data in it any more */
+static void local_cache_invalidate_slot(BDRVLocalCacheState *s,
+                                        LocalCacheSlot *slot)
+{
+    g_hash_table_remove(s->blocks, &slot->block);
+
+    if (slot->state == LOCAL_CACHE_SLOT_VALID) {
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        if (!slot->users) {
+            local_cache_free_slot(s, slot);
+            return;
+        }
+    }
+
+    slot->stale = true;
+    local_cache_update_entry(s, slot);
+}
+
+static void local_cache_invalidate(BDRVLocalCacheState *s, uint64_t offset,
+                                   uint64_t bytes)
+{
+    uint64_t block, last = (offset + bytes - 1) / s->block_size;
+    LocalCacheSlot *slot;
+
+    for (block = offset / s->block_size; block <= last; block++) {
+        slot = g_hash_table_lookup(s->blocks, &block);
+        if (slot) {
+            local_cache_invalidate_slot(s, slot);
+        }
+    }
+}
+
+/* Look up the slot that holds @block, waiting for it to be filled if
+ * necessary, and mark it as used until local_cache_put() */
+static LocalCacheSlot *coroutine_fn local_cache_get(BDRVLocalCacheState *s,
+                                                    uint64_t block)
+{
+    LocalCacheSlot *slot;
+
+    while ((slot = g_hash_table_lookup(s->blocks, &block)) &&
+           slot->state == LOCAL_CACHE_SLOT_BUSY) {
+        qemu_co_queue_wait(&slot->wait_queue, NULL);
+    }
+
+    if (slot) {
+        slot->users++;
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    }
+    return slot;
+}
+
+static void local_cache_put(BDRVLocalCacheState *s, LocalCacheSlot *slot)
+{
+    assert(slot->users);
+
+    if (--slot->users == 0) {
+        if (slot->stale) {
+            local_cache_free_slot(s, slot);
+        } else {
+            qemu_co_queue_restart_all(&s->free_queue);
+        }
+    }
+}
+
+static int coroutine_fn local_cache_slot_io(BlockDriverState *bs,
+                                            LocalCacheSlot *slot,
+                                            uint64_t in_block, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            uint64_t qiov_offset,
+                                            bool is_write)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t offset = local_cache_slot_offset(s, slot) + in_block;
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+    if (is_write) {
+        ret = bdrv_co_pwritev(s->cache_file, offset, bytes, &local_qiov, 0);
+    } else {
+        ret = bdrv_co_preadv(s->cache_file, offset, bytes, &local_qiov, 0);
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+/* Copy the data of a dirty slot to the image */
+static int coroutine_fn local_cache_write_back(BlockDriverState *bs,
+                                               LocalCacheSlot *slot)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t bytes = local_cache_block_bytes(s, slot->block);
+    void *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(s->cache_file, local_cache_slot_offset(s, slot),
+                        bytes, buf, 0);
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite(bs->file, slot->block * s->block_size,
+                             bytes, buf, 0);
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->image_flush_needed = true;
+    local_cache_set_dirty(s, slot, false);
+    return 0;
+}
+
+static int coroutine_fn local_cache_evict(BlockDriverState *bs,
+                                          LocalCacheSlot *slot)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    assert(slot->state == LOCAL_CACHE_SLOT_VALID && !slot->users);
+
+    trace_local_cache_evict(bs, slot->block, slot->dirty);
+    QTAILQ_REMOVE(&s->lru, slot, next);
+
+    if (slot->dirty) {
+        /* Requests for the block wait until the image is up to date */
+        slot->state = LOCAL_CACHE_SLOT_BUSY;
+        ret = local_cache_write_back(bs, slot);
+        if (ret < 0) {
+            slot->state = LOCAL_CACHE_SLOT_VALID;
+            QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+            qemu_co_queue_restart_all(&slot->wait_queue);
+            return ret;
+        }
+    }
+
+    g_hash_table_remove(s->blocks, &slot->block);
+    local_cache_free_slot(s, slot);
+    return 0;
+}
+
+/*
+ * Write the changed parts of the index to the cache file, so that it
+ * refers to all the blocks that have been filled or written so far.
+ *
+ * The changed pages are copied before anything is flushed.  Every slot
+ * they refer to holds its data already, so a single flush makes the data
+ * stable before the index on disk points to it.  Likewise, blocks that
+ * were written back to the image are stable before the index on disk
+ * stops pointing to the cached copy.
+ */
+static int coroutine_fn local_cache_checkpoint(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t nb_pages = s->index_size / LOCAL_CACHE_INDEX_PAGE;
+    unsigned long *pages;
+    uint8_t *snapshot = NULL;
+    LocalCacheSlot *slot, *next_slot;
+    bool flush_image;
+    uint64_t page, i, j, nb_dirty;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->checkpoint_lock);
+
+    pages = bitmap_new(nb_pages);
+    bitmap_copy(pages, s->index_dirty, nb_pages);
+    nb_dirty = bitmap_count_one(pages, nb_pages);
+    flush_image = s->image_flush_needed;
+
+    if (nb_dirty) {
+        snapshot = qemu_try_blockalign(s->cache_file->bs,
+                                       nb_dirty * LOCAL_CACHE_INDEX_PAGE);
+        if (!snapshot) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    trace_local_cache_checkpoint(bs, nb_dirty, flush_image);
+
+    j = 0;
+    for (page = find_first_bit(pages, nb_pages); page < nb_pages;
+         page = find_next_bit(pages, nb_pages, page + 1)) {
+        memcpy(snapshot + j * LOCAL_CACHE_INDEX_PAGE,
+               s->index + page * LOCAL_CACHE_ENTRIES_PER_PAGE,
+               LOCAL_CACHE_INDEX_PAGE);
+        j++;
+    }
+    bitmap_zero(s->index_dirty, nb_pages);
+    s->image_flush_needed = false;
+
+    if (flush_image) {
+        ret = bdrv_co_flush(bs->file->bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = bdrv_co_flush(s->cache_file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    j = 0;
+    for (page = find_first_bit(pages, nb_pages); page < nb_pages;
+         page = find_next_bit(pages, nb_pages, page + 1)) {
+        ret = bdrv_co_pwrite(s->cache_file,
+                             s->index_offset + page * LOCAL_CACHE_INDEX_PAGE,
+                             LOCAL_CACHE_INDEX_PAGE,
+                             snapshot + j * LOCAL_CACHE_INDEX_PAGE, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+        j++;
+    }
+
+    if (nb_dirty) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The index on disk now matches the snapshot */
+    j = 0;
+    for (page = find_first_bit(pages, nb_pages); page < nb_pages;
+         page = find_next_bit(pages, nb_pages, page + 1)) {
+        LocalCacheEntry *entries = (LocalCacheEntry *)
+            (snapshot + j * LOCAL_CACHE_INDEX_PAGE);
+
+        for (i = 0; i < LOCAL_CACHE_ENTRIES_PER_PAGE; i++) {
+            uint64_t n = page * LOCAL_CACHE_ENTRIES_PER_PAGE + i;
+
+            if (n >= s->nb_slots) {
+                break;
+            }
+            if (entries[i].block) {
+                set_bit(n, s->on_disk);
+            } else {
+                clear_bit(n, s->on_disk);
+            }
+        }
+        j++;
+    }
+
+    QTAILQ_FOREACH_SAFE(slot, &s->pending_list, next, next_slot) {
+        if (!test_bit(local_cache_slot_index(s, slot), s->on_disk)) {
+            QTAILQ_REMOVE(&s->pending_list, slot, next);
+            QTAILQ_INSERT_TAIL(&s->free_list, slot, next);
+        }
+    }
+    qemu_co_queue_restart_all(&s->free_queue);
+    goto out;
+
+fail:
+    /* Write the same pages again next time */
+    bitmap_or(s->index_dirty, s->index_dirty, pages, nb_pages);
+    s->image_flush_needed |= flush_image;
+out:
+    qemu_vfree(snapshot);
+    g_free(pages);
+    qemu_co_mutex_unlock(&s->checkpoint_lock);
+    return ret;
+}
+
+/*
+ * Take a slot off the free list and mark it BUSY, evicting the least
+ * recently used block if there is no free slot.  If all slots are in use,
+ * wait for one if @wait is true, or return NULL in *@pslot otherwise.
+ */
+static int coroutine_fn local_cache_alloc_slot(BlockDriverState *bs,
+                                               bool wait,
+                                               LocalCacheSlot **pslot)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheSlot *slot;
+    int ret;
+
+    for (;;) {
+        slot = QTAILQ_FIRST(&s->free_list);
+        if (slot) {
+            QTAILQ_REMOVE(&s->free_list, slot, next);
+            slot->state = LOCAL_CACHE_SLOT_BUSY;
+            *pslot = slot;
+            return 0;
+        }
+
+        if (!QTAILQ_EMPTY(&s->pending_list)) {
+            ret = local_cache_checkpoint(bs);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        QTAILQ_FOREACH(slot, &s->lru, next) {
+            if (!slot->users) {
+                break;
+            }
+        }
+        if (slot) {
+            ret = local_cache_evict(bs, slot);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (!wait) {
+            *pslot = NULL;
+            return 0;
+        }
+        qemu_co_queue_wait(&s->free_queue, NULL);
+    }
+}
+
+/*
+ * Read a run of blocks that are not cached from the image, starting with
+ * the block that contains @offset, and add them to the cache.  The part of
+ * the run that overlaps the request is copied to @qiov at @qiov_offset, and
+ * its length is returned in *@bytes_done; this is zero if somebody else
+ * started to fill the first block in the meantime.
+ */
+static int coroutine_fn local_cache_read_miss(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              uint64_t qiov_offset,
+                                              uint64_t *bytes_done)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheSlot *slots[LOCAL_CACHE_MAX_FILL_BLOCKS];
+    QEMUIOVector local_qiov;
+    uint64_t first = offset / s->block_size;
+    uint64_t last = (offset + bytes - 1) / s->block_size;
+    uint64_t nb_blocks, block, start, end, i;
+    uint8_t *buf;
+    int ret = 0;
+
+    last = MIN(last, first + s->max_fill_blocks - 1);
+    for (nb_blocks = 0; first + nb_blocks <= last; nb_blocks++) {
+        LocalCacheSlot *slot;
+
+        block = first + nb_blocks;
+        if (g_hash_table_lookup(s->blocks, &block)) {
+            break;
+        }
+
+        ret = local_cache_alloc_slot(bs, false, &slot);
+        if (ret < 0 || !slot) {
+            break;
+        }
+
+        /* Evicting may have yielded */
+        if (g_hash_table_lookup(s->blocks, &block)) {
+            local_cache_free_slot(s, slot);
+            break;
+        }
+
+        slot->block = block;
+        g_hash_table_insert(s->blocks, &slot->block, slot);
+        slots[nb_blocks] = slot;
+    }
+
+    if (nb_blocks == 0) {
+        *bytes_done = 0;
+        block = first;
+        if (g_hash_table_lookup(s->blocks, &block)) {
+            return 0;
+        }
+
+        /* No slot available, bypass the cache */
+        *bytes_done = MIN(bytes, s->block_size - offset % s->block_size);
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov, qiov_offset, *bytes_done);
+        ret = bdrv_co_preadv(bs->file, offset, *bytes_done, &local_qiov, 0);
+        qemu_iovec_destroy(&local_qiov);
+        return ret;
+    }
+
+    start = first * s->block_size;
+    end = MIN((first + nb_blocks) * s->block_size, s->image_size);
+    *bytes_done = MIN(offset + bytes, end) - offset;
+    trace_local_cache_fill(bs, first, nb_blocks);
+
+    buf = qemu_try_blockalign(bs->file->bs, nb_blocks * s->block_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    memset(buf + (end - start), 0, nb_blocks * s->block_size - (end - start));
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start),
+                        *bytes_done);
+
+    /* Errors from here on only mean that the blocks are not cached */
+    for (i = 0; i < nb_blocks; i++) {
+        int cache_ret;
+
+        cache_ret = bdrv_co_pwrite(s->cache_file,
+                                   local_cache_slot_offset(s, slots[i]),
+                                   s->block_size, buf + i * s->block_size, 0);
+        local_cache_slot_ready(s, slots[i], cache_ret >= 0);
+    }
+    nb_blocks = 0;
+
+out:
+    for (i = 0; i < nb_blocks; i++) {
+        local_cache_slot_ready(s, slots[i], false);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_preadv(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t bytes_done = 0;
+    int ret;
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t block = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(bytes - bytes_done, s->block_size - in_block);
+        LocalCacheSlot *slot = local_cache_get(s, block);
+
+        if (slot) {
+            bool dirty = slot->dirty;
+
+            trace_local_cache_hit(bs, block);
+            ret = local_cache_slot_io(bs, slot, in_block, n, qiov, bytes_done,
+                                      false);
+            if (ret < 0 && !dirty) {
+                /* The image has the same data, use it instead */
+                local_cache_invalidate_slot(s, slot);
+            }
+            local_cache_put(s, slot);
+            if (ret >= 0) {
+                bytes_done += n;
+                continue;
+            } else if (dirty) {
+                return ret;
+            }
+        }
+
+        ret = local_cache_read_miss(bs, pos, bytes - bytes_done, qiov,
+                                    bytes_done, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        bytes_done += n;
+    }
+
+    return 0;
+}
+
+/* Write part of a block that is not cached into a new slot, starting from
+ * the image data for the rest of the block.  Returns -EAGAIN if somebody
+ * else started to fill the block in the meantime. */
+static int coroutine_fn local_cache_write_miss(BlockDriverState *bs,
+                                               uint64_t block,
+                                               uint64_t in_block,
+                                               uint64_t bytes,
+                                               QEMUIOVector *qiov,
+                                               uint64_t qiov_offset)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t block_bytes = local_cache_block_bytes(s, block);
+    LocalCacheSlot *slot;
+    uint8_t *buf;
+    int ret;
+
+    ret = local_cache_alloc_slot(bs, true, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+    if (g_hash_table_lookup(s->blocks, &block)) {
+        local_cache_free_slot(s, slot);
+        return -EAGAIN;
+    }
+
+    slot->block = block;
+    g_hash_table_insert(s->blocks, &slot->block, slot);
+
+    buf = qemu_try_blockalign(s->cache_file->bs, s->block_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (in_block != 0 || bytes < block_bytes) {
+        ret = bdrv_co_pread(bs->file, block * s->block_size, block_bytes,
+                            buf, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    memset(buf + block_bytes, 0, s->block_size - block_bytes);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf + in_block, bytes);
+
+    ret = bdrv_co_pwrite(s->cache_file, local_cache_slot_offset(s, slot),
+                         s->block_size, buf, 0);
+    if (ret >= 0) {
+        local_cache_set_dirty(s, slot, true);
+    }
+
+out:
+    qemu_vfree(buf);
+    local_cache_slot_ready(s, slot, ret >= 0);
+    return ret;
+}
+
+static int coroutine_fn local_cache_co_pwritev(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t bytes_done = 0;
+    int ret;
+
+    /* The cache geometry depends on the image size, which cannot change */
+    if (offset + bytes > s->image_size) {
+        return -ENOSPC;
+    }
+
+    if (s->mode == LOCAL_CACHE_MODE_WRITETHROUGH) {
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+        /* Any cached copy (or one that was being made while the image was
+         * written) is outdated now */
+        local_cache_invalidate(s, offset, bytes);
+        return ret;
+    }
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t block = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(bytes - bytes_done, s->block_size - in_block);
+        LocalCacheSlot *slot = local_cache_get(s, block);
+
+        if (slot) {
+            ret = local_cache_slot_io(bs, slot, in_block, n, qiov, bytes_done,
+                                      true);
+            if (ret >= 0) {
+                local_cache_set_dirty(s, slot, true);
+            }
+            local_cache_put(s, slot);
+        } else {
+            ret = local_cache_write_miss(bs, block, in_block, n, qiov,
+                                         bytes_done);
+            if (ret == -EAGAIN) {
+                continue;
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        bytes_done += n;
+    }
+
+    return 0;
+}
+
+/* In write-back mode, -ENOTSUP makes the block layer write a zeroed buffer
+ * through local_cache_co_pwritev() instead, which takes care of the cached
+ * blocks */
+static int coroutine_fn local_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset, int bytes,
+                                                     BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    if (offset + bytes > s->image_size) {
+        return -ENOSPC;
+    }
+    if (s->mode == LOCAL_CACHE_MODE_WRITEBACK) {
+        return -ENOTSUP;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    local_cache_invalidate(s, offset, bytes);
+    return ret;
+}
+
+/* Discarding is only a hint, so write-back mode keeps the cached blocks and
+ * does not discard anything */
+static int coroutine_fn local_cache_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    if (s->mode == LOCAL_CACHE_MODE_WRITEBACK) {
+        return -ENOTSUP;
+    }
+
+    ret = bdrv_co_pdiscard(bs->file->bs, offset, bytes);
+    local_cache_invalidate(s, offset, bytes);
+    return ret;
+}
+
+static bool local_cache_block_is_dirty(BDRVLocalCacheState *s, uint64_t block)
+{
+    LocalCacheSlot *slot = g_hash_table_lookup(s->blocks, &block);
+
+    return slot && slot->dirty;
+}
+
+/* The image has the same data as the cache file, except for dirty blocks in
+ * write-back mode */
+static int64_t coroutine_fn local_cache_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+    BlockDriverState **file)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t start = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = (sector_num + nb_sectors) * BDRV_SECTOR_SIZE;
+    uint64_t block = start / s->block_size;
+    uint64_t pos = (block + 1) * s->block_size;
+    bool dirty = local_cache_block_is_dirty(s, block);
+
+    if (s->mode == LOCAL_CACHE_MODE_WRITETHROUGH) {
+        return bdrv_co_get_block_status_from_file(bs, sector_num, nb_sectors,
+                                                  pnum, file);
+    }
+
+    while (pos < end &&
+           local_cache_block_is_dirty(s, pos / s->block_size) == dirty) {
+        pos += s->block_size;
+    }
+    *pnum = (MIN(pos, end) - start) / BDRV_SECTOR_SIZE;
+
+    if (dirty) {
+        return BDRV_BLOCK_DATA;
+    }
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | start;
+}
+
+static int coroutine_fn local_cache_co_flush(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    if (s->mode == LOCAL_CACHE_MODE_WRITEBACK) {
+        return local_cache_checkpoint(bs);
+    }
+    return bdrv_co_flush(bs->file->bs);
+}
+
+/* Write all dirty blocks back to the image and persist the index */
+static int coroutine_fn local_cache_co_write_back_all(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheSlot *slot;
+    int ret = 0;
+
+    QTAILQ_FOREACH(slot, &s->lru, next) {
+        if (slot->dirty) {
+            ret = local_cache_write_back(bs, slot);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+
+    /* Persist what was written back even after an error */
+    if (ret < 0) {
+        local_cache_checkpoint(bs);
+        return ret;
+    }
+    return local_cache_checkpoint(bs);
+}
+
+typedef struct LocalCacheCo {
+    BlockDriverState *bs;
+    int ret;
+} LocalCacheCo;
+
+static void coroutine_fn local_cache_write_back_all_entry(void *opaque)
+{
+    LocalCacheCo *lcc = opaque;
+
+    lcc->ret = local_cache_co_write_back_all(lcc->bs);
+}
+
+static int local_cache_write_back_all(BlockDriverState *bs)
+{
+    Coroutine *co;
+    LocalCacheCo lcc = {
+        .bs     = bs,
+        .ret    = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        local_cache_write_back_all_entry(&lcc);
+    } else {
+        co = qemu_coroutine_create(local_cache_write_back_all_entry, &lcc);
+        bdrv_coroutine_enter(bs, co);
+        BDRV_POLL_WHILE(bs, lcc.ret == -EINPROGRESS);
+    }
+    return lcc.ret;
+}
+
+static int local_cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header = {
+        .magic          = cpu_to_be64(LOCAL_CACHE_MAGIC),
+        .version        = cpu_to_be32(LOCAL_CACHE_VERSION),
+        .flags          = cpu_to_be32(flags),
+        .block_size     = cpu_to_be32(s->block_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .image_size     = cpu_to_be64(s->image_size),
+        .index_offset   = cpu_to_be64(s->index_offset),
+        .data_offset    = cpu_to_be64(s->data_offset),
+    };
+    int ret;
+
+    memcpy(header.image_id, s->image_id, sizeof(header.image_id));
+    ret = bdrv_pwrite(s->cache_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(s->cache_file->bs);
+}
+
+/* Empty the cache file and give it the size for the current geometry */
+static int local_cache_format(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_pwrite_zeroes(s->cache_file, 0, s->data_offset, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not clear the cache file");
+        return ret;
+    }
+
+    /* Slot data is only ever read after it was written, so the rest of the
+     * cache file can stay sparse */
+    ret = bdrv_truncate(s->cache_file,
+                        s->data_offset + s->nb_slots * s->block_size,
+                        PREALLOC_MODE_OFF, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache_file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the cache file");
+        return ret;
+    }
+
+    memset(s->index, 0, s->index_size);
+    bitmap_zero(s->on_disk, s->nb_slots);
+    return 0;
+}
+
+/*
+ * Identify the image by its filename, which for images that are not plain
+ * files includes all the options that select the image (json:{...}).
+ * Changes to the image that are not made through this node cannot be
+ * detected, so this only catches a cache file that is passed together with
+ * the wrong image.
+ */
+static int local_cache_compute_image_id(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    BlockDriverState *image = bs->file->bs;
+    uint8_t *digest = NULL;
+    size_t digest_len;
+    int ret;
+
+    bdrv_refresh_filename(image);
+    ret = qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, image->filename,
+                             strlen(image->filename), &digest, &digest_len,
+                             errp);
+    if (ret < 0) {
+        return -EINVAL;
+    }
+
+    assert(digest_len == sizeof(s->image_id));
+    memcpy(s->image_id, digest, sizeof(s->image_id));
+    g_free(digest);
+    return 0;
+}
+
+/*
+ * Read the header and the index of the cache file.  If it belongs to
+ * another image, another image size or another geometry, it is formatted
+ * again.  Returns 1 if the index was loaded, 0 if the cache file was
+ * formatted.
+ */
+static int local_cache_load(BlockDriverState *bs, bool *recover,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    uint32_t flags;
+    int ret;
+
+    *recover = false;
+
+    ret = bdrv_pread(s->cache_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache file header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != LOCAL_CACHE_MAGIC ||
+        be32_to_cpu(header.version) != LOCAL_CACHE_VERSION) {
+        goto format;
+    }
+
+    flags = be32_to_cpu(header.flags);
+    if (memcmp(header.image_id, s->image_id, sizeof(s->image_id))) {
+        if ((flags & LOCAL_CACHE_F_IN_USE) &&
+            (flags & LOCAL_CACHE_F_WRITEBACK)) {
+            error_setg(errp, "The cache file holds data that was not written "
+                       "back to the image, but was used with a different "
+                       "image");
+            return -EINVAL;
+        }
+        goto format;
+    }
+
+    if (be32_to_cpu(header.block_size) != s->block_size ||
+        be64_to_cpu(header.nb_slots) != s->nb_slots ||
+        be64_to_cpu(header.image_size) != s->image_size ||
+        be64_to_cpu(header.index_offset) != s->index_offset ||
+        be64_to_cpu(header.data_offset) != s->data_offset) {
+        if ((flags & LOCAL_CACHE_F_IN_USE) &&
+            (flags & LOCAL_CACHE_F_WRITEBACK)) {
+            error_setg(errp, "The cache file holds data that was not written "
+                       "back to the image, but was used with a different "
+                       "image size, block-size or cache-size");
+            return -EINVAL;
+        }
+        goto format;
+    }
+
+    if ((flags & LOCAL_CACHE_F_IN_USE) &&
+        !(flags & LOCAL_CACHE_F_WRITEBACK)) {
+        /* Writes may have bypassed the cached copies */
+        goto format;
+    }
+
+    ret = bdrv_pread(s->cache_file, s->index_offset, s->index, s->index_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache file index");
+        return ret;
+    }
+
+    *recover = flags & LOCAL_CACHE_F_IN_USE;
+    return 1;
+
+format:
+    ret = local_cache_format(bs, errp);
+    return ret < 0 ? ret : 0;
+}
+
+/* Build the in-memory state from s->index */
+static void local_cache_init_slots(BlockDriverState *bs, bool recover)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t nb_blocks = DIV_ROUND_UP(s->image_size, s->block_size);
+    uint64_t i;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        LocalCacheSlot *slot = &s->slots[i];
+        uint64_t entry = be64_to_cpu(s->index[i].block);
+        uint64_t flags = be64_to_cpu(s->index[i].flags);
+
+        qemu_co_queue_init(&slot->wait_queue);
+        slot->block = entry - 1;
+
+        if (entry) {
+            set_bit(i, s->on_disk);
+        }
+
+        if (entry == 0 || entry > nb_blocks ||
+            g_hash_table_lookup(s->blocks, &slot->block)) {
+            local_cache_free_slot(s, slot);
+            continue;
+        }
+
+        slot->state = LOCAL_CACHE_SLOT_VALID;
+        g_hash_table_insert(s->blocks, &slot->block, slot);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+
+        /* After a crash in write-back mode any block may be newer than
+         * the image */
+        if (recover || (flags & LOCAL_CACHE_ENTRY_DIRTY)) {
+            local_cache_set_dirty(s, slot, true);
+        }
+    }
+
+    /* Nothing changed yet except where invalid entries were dropped */
+    bitmap_zero(s->index_dirty, s->index_size / LOCAL_CACHE_INDEX_PAGE);
+    for (i = 0; i < s->nb_slots; i++) {
+        if (s->slots[i].state == LOCAL_CACHE_SLOT_FREE &&
+            test_bit(i, s->on_disk)) {
+            set_bit(i / LOCAL_CACHE_ENTRIES_PER_PAGE, s->index_dirty);
+        }
+    }
+}
+
+static void local_cache_free_state(BDRVLocalCacheState *s)
+{
+    if (s->blocks) {
+        g_hash_table_destroy(s->blocks);
+    }
+    g_free(s->slots);
+    qemu_vfree(s->index);
+    g_free(s->index_dirty);
+    g_free(s->on_disk);
+}
+
+static void local_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   const BdrvChildRole *role,
+                                   BlockReopenQueue *reopen_queue,
+                                   uint64_t perm, uint64_t shared,
+                                   uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    /* The image is attached first, so a new child is the cache file if the
+     * image is there already */
+    if (c ? c == s->cache_file : bs->file != NULL) {
+        /* The cache file is always written, even if this node is
+         * read-only, and nobody else may change it */
+        *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE | BLK_PERM_RESIZE;
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    /* In write-back mode the image is written behind the guest's back, and
+     * it must not change under the cached copies in any mode */
+    bdrv_format_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+}
+
+static int local_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cache_size, block_size, nb_pages;
+    bool recover;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_CACHE_SIZE,
+                                   LOCAL_CACHE_DEFAULT_SIZE);
+    block_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_BLOCK_SIZE,
+                                   LOCAL_CACHE_DEFAULT_BLOCK_SIZE);
+    s->mode = qapi_enum_parse(&LocalCacheMode_lookup,
+                              qemu_opt_get(opts, LOCAL_CACHE_OPT_MODE),
+                              LOCAL_CACHE_MODE_WRITETHROUGH, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (block_size < LOCAL_CACHE_MIN_BLOCK_SIZE ||
+        block_size > LOCAL_CACHE_MAX_BLOCK_SIZE || !is_power_of_2(block_size)) {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d", LOCAL_CACHE_MIN_BLOCK_SIZE,
+                   LOCAL_CACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (cache_size < block_size ||
+        cache_size / block_size > LOCAL_CACHE_MAX_SLOTS) {
+        error_setg(errp, "cache-size must hold between 1 and %d blocks",
+                   LOCAL_CACHE_MAX_SLOTS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->block_size = block_size;
+    s->nb_slots = cache_size / block_size;
+    s->max_fill_blocks = MIN(LOCAL_CACHE_MAX_FILL_BLOCKS,
+                             MAX(LOCAL_CACHE_MAX_FILL_BYTES / block_size, 1));
+    s->index_offset = LOCAL_CACHE_HEADER_SIZE;
+    s->index_size = ROUND_UP(s->nb_slots * sizeof(LocalCacheEntry),
+                             LOCAL_CACHE_INDEX_PAGE);
+    s->data_offset = ROUND_UP(s->index_offset + s->index_size, block_size);
+
+    /* Unless the cache file is an existing node, open it read-write even if
+     * this node is read-only */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_file, false, errp);
+    if (!s->cache_file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        ret = s->image_size;
+        error_setg_errno(errp, -ret, "Could not get image size");
+        goto fail;
+    }
+
+    ret = local_cache_compute_image_id(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    nb_pages = s->index_size / LOCAL_CACHE_INDEX_PAGE;
+    s->index = qemu_try_blockalign(s->cache_file->bs, s->index_size);
+    if (!s->index) {
+        error_setg(errp, "Could not allocate the cache index");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->index_dirty = bitmap_new(nb_pages);
+    s->on_disk = bitmap_new(s->nb_slots);
+    s->slots = g_new0(LocalCacheSlot, s->nb_slots);
+    s->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free_list);
+    QTAILQ_INIT(&s->pending_list);
+    qemu_co_queue_init(&s->free_queue);
+    qemu_co_mutex_init(&s->checkpoint_lock);
+
+    ret = local_cache_load(bs, &recover, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    local_cache_init_slots(bs, recover);
+
+    if (s->nb_dirty) {
+        if (bdrv_is_read_only(bs)) {
+            error_setg(errp, "The cache file holds data that was not written "
+                       "back to the image; open the node read-write to "
+                       "recover it");
+            ret = -EPERM;
+            goto fail;
+        }
+
+        ret = local_cache_write_back_all(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write back the data in "
+                             "the cache file");
+            goto fail;
+        }
+    }
+
+    /* Write-back mode emulates FUA with a checkpoint */
+    if (s->mode == LOCAL_CACHE_MODE_WRITETHROUGH) {
+        bs->supported_write_flags = bs->file->bs->supported_write_flags;
+        bs->supported_zero_flags = bs->file->bs->supported_zero_flags;
+    }
+
+    ret = local_cache_write_header(bs, LOCAL_CACHE_F_IN_USE |
+                                   (s->mode == LOCAL_CACHE_MODE_WRITEBACK ?
+                                    LOCAL_CACHE_F_WRITEBACK : 0));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache file header");
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        local_cache_free_state(s);
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void local_cache_close(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    ret = local_cache_write_back_all(bs);
+    if (ret >= 0) {
+        ret = local_cache_write_header(bs, 0);
+    }
+    if (ret < 0) {
+        warn_report("local-cache: could not close the cache file cleanly: "
+                    "%s", strerror(-ret));
+    }
+
+    local_cache_free_state(s);
+}
+
+static int local_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    BDRVLocalCacheState *s = reopen_state->bs->opaque;
+
+    /* Dirty blocks can only be evicted by writing them to the image */
+    if (s->nb_dirty && !(reopen_state->flags & BDRV_O_RDWR)) {
+        error_setg(errp, "Cannot make a write-back local-cache node "
+                   "read-only while it holds data that was not written "
+                   "back to the image");
+        return -EPERM;
+    }
+    return 0;
+}
+
+static int64_t local_cache_getlength(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    return s->image_size;
+}
+
+static BlockDriver bdrv_local_cache = {
+    .format_name                = "local-cache",
+    .protocol_name              = "local-cache",
+    .instance_size              = sizeof(BDRVLocalCacheState),
+
+    .bdrv_file_open             = local_cache_open,
+    .bdrv_close                 = local_cache_close,
+    .bdrv_reopen_prepare        = local_cache_reopen_prepare,
+    .bdrv_child_perm            = local_cache_child_perm,
+
+    .bdrv_getlength             = local_cache_getlength,
+
+    .bdrv_co_preadv             = local_cache_co_preadv,
+    .bdrv_co_pwritev            = local_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = local_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = local_cache_co_pdiscard,
+    .bdrv_co_flush              = local_cache_co_flush,
+    .bdrv_co_get_block_status   = local_cache_co_get_block_status,
+};
+
+static void bdrv_local_cache_init(void)
+{
+    bdrv_register(&bdrv_local_cache);
+}
+
+block_init(bdrv_local_cache_init);
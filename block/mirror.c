@@ -73,6 +73,8 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    /* Cleared once the first copy offload attempt turns out unsupported */
+    bool use_copy_range;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -174,6 +176,29 @@ static void mirror_read_complete(void *opaque, int ret)
     aio_context_release(blk_get_aio_context(s->common.blk));
 }
 
+/* Try to let the storage copy the data; the buffers in op->qiov are only
+ * needed if this fails and the data has to be read after all */
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->offset, s->target, op->offset,
+                            op->bytes, 0, 0);
+    if (ret >= 0) {
+        mirror_write_complete(op, ret);
+        return;
+    }
+
+    trace_mirror_copy_range_fail(s, op->offset, op->bytes, ret);
+    if (ret == -ENOTSUP) {
+        s->use_copy_range = false;
+    }
+    blk_aio_preadv(s->common.blk, op->offset, &op->qiov, 0,
+                   mirror_read_complete, op);
+}
+
 /* Clip bytes relative to offset to not exceed end-of-file */
 static inline int64_t mirror_clip_bytes(MirrorBlockJob *s,
                                         int64_t offset,
@@ -291,6 +316,12 @@ static uint64_t mirror_do_read(MirrorBlockJob *s, int64_t offset,
     s->bytes_in_flight += bytes;
     trace_mirror_one_iteration(s, offset, bytes);
 
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        qemu_coroutine_enter(co);
+        return ret;
+    }
+
     blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
     return ret;
 }
@@ -325,6 +356,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->source;
     int64_t offset, first_chunk;
+    uint64_t area_offset, area_bytes;
     uint64_t delay_ns = 0;
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
@@ -349,29 +381,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     block_job_pause_point(&s->common);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+    /* Find the number of consecutive dirty chunks following the first dirty
+     * one that are not in flight yet. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    while (nb_chunks * s->granularity < s->buf_size) {
-        int64_t next_dirty;
-        int64_t next_offset = offset + nb_chunks * s->granularity;
-        int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_get_dirty_locked(source, s->dirty_bitmap, next_offset)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
-
-        next_dirty = bdrv_dirty_iter_next(s->dbi);
-        if (next_dirty > next_offset || next_dirty < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(s->dbi, next_offset);
-            next_dirty = bdrv_dirty_iter_next(s->dbi);
+    area_offset = offset;
+    area_bytes = s->buf_size;
+    if (bdrv_dirty_bitmap_next_dirty_area(s->dirty_bitmap, &area_offset,
+                                          &area_bytes) &&
+        area_offset == offset)
+    {
+        int64_t nb_dirty = DIV_ROUND_UP(area_bytes, s->granularity);
+
+        while (nb_chunks < nb_dirty &&
+               !test_bit(first_chunk + nb_chunks, s->in_flight_bitmap)) {
+            nb_chunks++;
         }
-        assert(next_dirty == next_offset);
-        nb_chunks++;
     }
 
     /* Clear dirty bits before querying the block status, because
@@ -1054,6 +1078,24 @@ static int coroutine_fn bdrv_mirror_top_pdiscard(BlockDriverState *bs,
     return bdrv_co_pdiscard(bs->backing->bs, offset, bytes);
 }
 
+static int coroutine_fn bdrv_mirror_top_copy_range_from(BlockDriverState *bs,
+    BdrvChild *src, int64_t src_offset, BdrvChild *dst, int64_t dst_offset,
+    unsigned int bytes, BdrvRequestFlags read_flags,
+    BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_from(bs->backing, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
+}
+
+static int coroutine_fn bdrv_mirror_top_copy_range_to(BlockDriverState *bs,
+    BdrvChild *src, int64_t src_offset, BdrvChild *dst, int64_t dst_offset,
+    unsigned int bytes, BdrvRequestFlags read_flags,
+    BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, bs->backing, dst_offset,
+                                 bytes, read_flags, write_flags);
+}
+
 static void bdrv_mirror_top_refresh_filename(BlockDriverState *bs, QDict *opts)
 {
     if (bs->backing == NULL) {
@@ -1094,6 +1136,8 @@ static BlockDriver bdrv_mirror_top = {
     .bdrv_co_pwrite_zeroes      = bdrv_mirror_top_pwrite_zeroes,
     .bdrv_co_pdiscard           = bdrv_mirror_top_pdiscard,
     .bdrv_co_flush              = bdrv_mirror_top_flush,
+    .bdrv_co_copy_range_from    = bdrv_mirror_top_copy_range_from,
+    .bdrv_co_copy_range_to      = bdrv_mirror_top_copy_range_to,
     .bdrv_co_get_block_status   = bdrv_co_get_block_status_from_backing,
     .bdrv_refresh_filename      = bdrv_mirror_top_refresh_filename,
     .bdrv_close                 = bdrv_mirror_top_close,
@@ -1219,6 +1263,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -47,10 +47,21 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_session_detach_aio_context(NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+}
+
+static void nbd_session_attach_aio_context(NBDClientSession *client,
+                                           AioContext *new_context)
+{
+    qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
+    aio_co_schedule(new_context, client->read_reply_co);
+}
 
+static void nbd_teardown_connection(BlockDriverState *bs,
+                                    NBDClientSession *client)
+{
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -61,7 +72,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     BDRV_POLL_WHILE(bs, client->read_reply_co);
 
-    nbd_client_detach_aio_context(bs);
+    nbd_session_detach_aio_context(client);
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -118,11 +129,10 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -640,12 +650,33 @@ static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+/*
+ * Returns the connection with the fewest requests in flight.  Connections
+ * that failed are only used if no other one is left, so that their requests
+ * fail right away.
+ */
+static NBDClientSession *nbd_pick_client_session(BlockDriverState *bs)
+{
+    NBDClientSession *best = nbd_get_client_session(bs, 0);
+    int n = nbd_get_num_client_sessions(bs);
+    int i;
+
+    for (i = 1; i < n; i++) {
+        NBDClientSession *s = nbd_get_client_session(bs, i);
+
+        if (!s->quit && (best->quit || s->in_flight < best->in_flight)) {
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+static int nbd_co_request(NBDClientSession *client, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -654,7 +685,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(client, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -671,7 +702,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -684,7 +715,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -700,7 +731,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -718,13 +749,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(client, &request, qiov);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int bytes, BdrvRequestFlags flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -747,12 +778,12 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
 
     if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
@@ -762,12 +793,14 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    /* With several connections, the server guarantees that a flush covers the
+     * writes completed on all of them (NBD_FLAG_CAN_MULTI_CONN) */
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -779,45 +812,61 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    int i;
+
+    for (i = 0; i < nbd_get_num_client_sessions(bs); i++) {
+        nbd_session_detach_aio_context(nbd_get_client_session(bs, i));
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
-    aio_co_schedule(new_context, client->read_reply_co);
+    int i;
+
+    for (i = 0; i < nbd_get_num_client_sessions(bs); i++) {
+        nbd_session_attach_aio_context(nbd_get_client_session(bs, i),
+                                       new_context);
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < nbd_get_num_client_sessions(bs); i++) {
+        NBDClientSession *client = nbd_get_client_session(bs, i);
+
+        if (client->ioc == NULL) {
+            continue;
+        }
 
-    nbd_send_request(client->ioc, &request);
+        nbd_send_request(client->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(bs, client);
+    }
 }
 
+/*
+ * Negotiates the connection @sioc into the client session @index of @bs.
+ * Sessions other than the first one must talk to the same export, and are
+ * only opened if it advertised NBD_FLAG_CAN_MULTI_CONN.
+ */
 int nbd_client_init(BlockDriverState *bs,
+                    int index,
                     QIOChannelSocket *sioc,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_get_client_session(bs, index);
     int ret;
 
     /* NBD handshake */
@@ -833,6 +882,21 @@ int nbd_client_init(BlockDriverState *bs,
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
+    if (index > 0) {
+        NBDExportInfo *first = &nbd_get_client_session(bs, 0)->info;
+
+        if (client->info.size != first->size ||
+            client->info.flags != first->flags ||
+            client->info.structured_reply != first->structured_reply) {
+            error_setg(errp, "NBD server changed the export parameters "
+                       "between connections");
+            if (client->ioc) {
+                object_unref(OBJECT(client->ioc));
+                client->ioc = NULL;
+            }
+            return -EINVAL;
+        }
+    }
     if (client->info.flags & NBD_FLAG_READ_ONLY &&
         !bdrv_is_read_only(bs)) {
         error_setg(errp,
@@ -864,7 +928,7 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_session_attach_aio_context(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -16,6 +16,7 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define NBD_MAX_CONNECTIONS 16
 
 typedef struct {
     Coroutine *coroutine;
@@ -38,9 +39,11 @@ typedef struct NBDClientSession {
     bool quit;
 } NBDClientSession;
 
-NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
+NBDClientSession *nbd_get_client_session(BlockDriverState *bs, int index);
+int nbd_get_num_client_sessions(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs,
+                    int index,
                     QIOChannelSocket *sock,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
@@ -29,6 +29,7 @@
 #include "qemu/osdep.h"
 #include "block/nbd-client.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "qemu/uri.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
@@ -43,11 +44,14 @@
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NBDClientSession client;
+    /* Requests are spread over client[0 .. num_clients - 1] */
+    NBDClientSession client[NBD_MAX_CONNECTIONS];
+    int num_clients;
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
     char *export, *tlscredsid;
+    int connections;
 } BDRVNBDState;
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -299,10 +303,18 @@ done:
     return saddr;
 }
 
-NBDClientSession *nbd_get_client_session(BlockDriverState *bs)
+NBDClientSession *nbd_get_client_session(BlockDriverState *bs, int index)
 {
     BDRVNBDState *s = bs->opaque;
-    return &s->client;
+
+    assert(index >= 0 && index < NBD_MAX_CONNECTIONS);
+    return &s->client[index];
+}
+
+int nbd_get_num_client_sessions(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    return s->num_clients;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -388,10 +400,46 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of connections to the export",
+        },
         { /* end of list */ }
     },
 };
 
+/*
+ * Opens more connections to the export until s->connections are in use.  If
+ * the server refuses one, the connections established so far are kept.
+ */
+static void nbd_add_connections(BlockDriverState *bs,
+                                QCryptoTLSCreds *tlscreds,
+                                const char *hostname)
+{
+    BDRVNBDState *s = bs->opaque;
+    Error *local_err = NULL;
+
+    while (s->num_clients < s->connections) {
+        QIOChannelSocket *sioc;
+        int ret = -ECONNREFUSED;
+
+        sioc = nbd_establish_connection(s->saddr, &local_err);
+        if (sioc) {
+            ret = nbd_client_init(bs, s->num_clients, sioc, s->export,
+                                  tlscreds, hostname, &local_err);
+            object_unref(OBJECT(sioc));
+        }
+        if (ret < 0) {
+            warn_report("Using %d of %d NBD connections: %s", s->num_clients,
+                        s->connections, error_get_pretty(local_err));
+            error_free(local_err);
+            return;
+        }
+        s->num_clients++;
+    }
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -423,6 +471,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->export = g_strdup(qemu_opt_get(opts, "export"));
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     s->tlscredsid = g_strdup(qemu_opt_get(opts, "tls-creds"));
     if (s->tlscredsid) {
         tlscreds = nbd_get_tls_creds(s->tlscredsid, errp);
@@ -448,8 +503,19 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* NBD handshake */
-    ret = nbd_client_init(bs, sioc, s->export,
+    ret = nbd_client_init(bs, 0, sioc, s->export,
                           tlscreds, hostname, errp);
+    if (ret == 0) {
+        s->num_clients = 1;
+
+        /* Other connections would not see our writes consistently unless the
+         * server says so */
+        if (s->client[0].info.flags & NBD_FLAG_CAN_MULTI_CONN) {
+            nbd_add_connections(bs, tlscreds, hostname);
+        } else if (s->connections > 1) {
+            warn_report("NBD server does not support multiple connections");
+        }
+    }
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -473,7 +539,7 @@ static int nbd_co_flush(BlockDriverState *bs)
 
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
+    NBDClientSession *s = nbd_get_client_session(bs, 0);
     uint32_t max = MIN_NON_ZERO(NBD_MAX_BUFFER_SIZE, s->info.max_block);
 
     bs->bl.max_pdiscard = max;
@@ -501,7 +567,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.info.size;
+    return s->client[0].info.size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -561,6 +627,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put_str(opts, "tls-creds", s->tlscredsid);
     }
+    if (s->connections > 1) {
+        qdict_put_int(opts, "connections", s->connections);
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -454,6 +454,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
     }
+
+    ds->rd_latency_histogram =
+        block_latency_histogram_info(stats, BLOCK_ACCT_READ);
+    ds->has_rd_latency_histogram = ds->rd_latency_histogram != NULL;
+    ds->wr_latency_histogram =
+        block_latency_histogram_info(stats, BLOCK_ACCT_WRITE);
+    ds->has_wr_latency_histogram = ds->wr_latency_histogram != NULL;
+    ds->flush_latency_histogram =
+        block_latency_histogram_info(stats, BLOCK_ACCT_FLUSH);
+    ds->has_flush_latency_histogram = ds->flush_latency_histogram != NULL;
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
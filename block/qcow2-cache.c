@@ -33,6 +33,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Unreferenced entries are kept on the LRU list */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -43,6 +47,17 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Incremented whenever a table is written back or dropped, so that
+     * tables read from disk without a cache entry can be checked for
+     * staleness, see qcow2_cache_insert() */
+    uint64_t                generation;
+
+    /* Cached table offset -> entry index, chained through hash_next */
+    int                    *buckets;
+    int                     hash_bits;
+    /* Entries with ref == 0, least recently used (or unused) first */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -62,6 +77,57 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return &c->buckets[(offset * 0x9e3779b97f4a7c15ULL) >> (64 - c->hash_bits)];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Change the offset of entry i, keeping the hash table up to date.  An
+ * offset of 0 marks the entry as unused. */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        for (p = qcow2_cache_bucket(c, t->offset); *p != i;
+             p = &c->entries[*p].hash_next) {
+            assert(*p >= 0);
+        }
+        *p = t->hash_next;
+    }
+
+    t->offset = offset;
+    t->hash_next = -1;
+    if (offset) {
+        p = qcow2_cache_bucket(c, offset);
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
+/* Make an unreferenced, unused entry the first candidate for eviction */
+static void qcow2_cache_lru_move_to_head(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    QTAILQ_REMOVE(&c->lru, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->lru, t, lru_entry);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -111,8 +177,9 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
+            qcow2_cache_lru_move_to_head(c, i);
             i++;
             to_clean++;
         }
@@ -130,17 +197,33 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
 
+    size_t num_buckets;
+    int i;
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    /* Keep the load factor of the hash table at or below 1/2 */
+    num_buckets = pow2ceil(MAX(num_tables, 1)) * 2;
+    c->hash_bits = ctz64(num_buckets);
+    c->buckets = g_try_new(int, num_buckets);
+
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    memset(c->buckets, -1, num_buckets * sizeof(int));
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_entry);
     }
 
     return c;
@@ -156,6 +239,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -222,6 +306,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
+    c->generation++;
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
                       qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
     if (ret < 0) {
@@ -303,9 +388,10 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    c->generation++;
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
+        qcow2_cache_set_offset(c, i, 0);
         c->entries[i].lru_counter = 0;
     }
 
@@ -320,11 +406,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *victim;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,40 +423,34 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    victim = QTAILQ_FIRST(&c->lru);
+    if (victim == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write a table back and replace it.  Take the entry off
+     * the LRU list so that nobody else picks it while we yield. */
+    i = victim - c->entries;
+    QTAILQ_REMOVE(&c->lru, victim, lru_entry);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
+        QTAILQ_INSERT_HEAD(&c->lru, victim, lru_entry);
         return ret;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -382,15 +460,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                          qcow2_cache_get_table_addr(bs, c, i),
                          s->cluster_size);
         if (ret < 0) {
+            QTAILQ_INSERT_HEAD(&c->lru, victim, lru_entry);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
+    c->entries[i].ref++;
+    goto done;
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru_entry);
+    }
+done:
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -411,6 +495,54 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+int qcow2_cache_get_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+uint64_t qcow2_cache_get_generation(Qcow2Cache *c)
+{
+    return c->generation;
+}
+
+/*
+ * Add a table that was read from disk at @offset without a cache entry,
+ * such as a prefetched L2 table.  @generation must have been taken with
+ * qcow2_cache_get_generation() before the read started; if tables were
+ * written back or dropped since then, @table may be stale and is not
+ * added.  Nothing is done either if the table is cached already or if
+ * there is no clean, unreferenced entry to replace.  Never yields.
+ */
+void qcow2_cache_insert(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                        const void *table, uint64_t generation)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *victim;
+    int i;
+
+    if (generation != c->generation || qcow2_cache_lookup(c, offset) >= 0) {
+        return;
+    }
+
+    QTAILQ_FOREACH(victim, &c->lru, lru_entry) {
+        if (!victim->dirty) {
+            break;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+
+    i = victim - c->entries;
+    qcow2_cache_set_offset(c, i, offset);
+    memcpy(qcow2_cache_get_table_addr(bs, c, i), table, s->cluster_size);
+
+    /* The table is about to be used, do not evict it first */
+    victim->lru_counter = ++c->lru_counter;
+    QTAILQ_REMOVE(&c->lru, victim, lru_entry);
+    QTAILQ_INSERT_TAIL(&c->lru, victim, lru_entry);
+}
+
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(bs, c, *table);
@@ -420,6 +552,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -436,14 +569,9 @@ void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
 void *qcow2_cache_is_table_offset(BlockDriverState *bs, Qcow2Cache *c,
                                   uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(bs, c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(bs, c, i) : NULL;
 }
 
 void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, void *table)
@@ -452,9 +580,11 @@ void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    c->generation++;
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
+    qcow2_cache_lru_move_to_head(c, i);
 
     qcow2_cache_table_release(bs, c, i, 1);
 }
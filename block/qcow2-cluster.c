@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -212,6 +211,112 @@ static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
                            (void **)l2_table);
 }
 
+/* Number of L2 tables that are read ahead of a sequential stream */
+#define L2_PREFETCH_TABLES      2
+
+/* Largest step forward between lookups that still counts as sequential */
+#define L2_PREFETCH_MAX_GAP     (4 * 1024 * 1024)
+
+typedef struct Qcow2L2Prefetch {
+    BlockDriverState *bs;
+    uint64_t l1_index;
+    uint64_t l1_entry;
+    uint64_t generation;
+} Qcow2L2Prefetch;
+
+static void coroutine_fn l2_prefetch_entry(void *opaque)
+{
+    Qcow2L2Prefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_offset = p->l1_entry & L1E_OFFSET_MASK;
+    void *table;
+    int ret = -ENOMEM;
+
+    /* Read without s->lock, so that requests using other tables go on */
+    table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (table) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+        ret = bdrv_co_pread(bs->file, l2_offset, s->cluster_size, table, 0);
+    }
+
+    if (ret >= 0) {
+        qemu_co_mutex_lock(&s->lock);
+        /* A new L2 table may have been allocated in the meantime */
+        if (p->l1_index < s->l1_size &&
+            s->l1_table[p->l1_index] == p->l1_entry) {
+            qcow2_cache_insert(bs, s->l2_table_cache, l2_offset, table,
+                               p->generation);
+        }
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    trace_qcow2_l2_prefetch_done(bs, p->l1_index, ret);
+    qemu_vfree(table);
+    g_free(p);
+    bdrv_dec_in_flight(bs);
+}
+
+static void l2_prefetch_table(BlockDriverState *bs, uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    Qcow2L2Prefetch *p;
+    Coroutine *co;
+
+    if (!l2_offset || offset_into_cluster(s, l2_offset) ||
+        qcow2_cache_is_table_offset(bs, s->l2_table_cache, l2_offset)) {
+        return;
+    }
+
+    p = g_new(Qcow2L2Prefetch, 1);
+    *p = (Qcow2L2Prefetch) {
+        .bs         = bs,
+        .l1_index   = l1_index,
+        .l1_entry   = s->l1_table[l1_index],
+        .generation = qcow2_cache_get_generation(s->l2_table_cache),
+    };
+
+    trace_qcow2_l2_prefetch(bs, l1_index, l2_offset);
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(l2_prefetch_entry, p);
+    bdrv_coroutine_enter(bs, co);
+}
+
+/*
+ * Called for each L2 table lookup.  Once a sequential stream gets into the
+ * second half of an L2 table, the next L2_PREFETCH_TABLES tables are read
+ * into the cache in the background, so that the stream does not wait for
+ * them when it gets there.
+ */
+static void l2_prefetch(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    uint64_t last = s->l2_prefetch_last_offset;
+    uint64_t i, start, end;
+
+    s->l2_prefetch_last_offset = offset;
+    if (offset < last || offset - last > L2_PREFETCH_MAX_GAP) {
+        s->l2_prefetch_end = 0;
+        return;
+    }
+
+    /* Prefetched tables must not push out the ones in use */
+    if (offset_to_l2_index(s, offset) < s->l2_size / 2 ||
+        qcow2_cache_get_size(s->l2_table_cache) < 4 * L2_PREFETCH_TABLES ||
+        (bs->open_flags & BDRV_O_INACTIVE)) {
+        return;
+    }
+
+    start = MAX(l1_index + 1, s->l2_prefetch_end);
+    end = MIN(l1_index + 1 + L2_PREFETCH_TABLES, s->l1_size);
+    for (i = start; i < end; i++) {
+        l2_prefetch_table(bs, i);
+    }
+    s->l2_prefetch_end = MAX(s->l2_prefetch_end, end);
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -272,7 +377,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -303,7 +408,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->l2_size * l2_entry_size(s));
     } else {
         uint64_t* old_table;
 
@@ -350,7 +455,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -363,13 +468,13 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset) {
@@ -382,8 +487,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -395,8 +500,10 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
  * Checks how many consecutive unallocated clusters in a given L2
  * table have the same cluster type.
  */
-static int count_contiguous_clusters_unallocated(int nb_clusters,
+static int count_contiguous_clusters_unallocated(BDRVQcow2State *s,
+                                                 int nb_clusters,
                                                  uint64_t *l2_table,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
     int i;
@@ -404,7 +511,7 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_table[i]);
+        uint64_t entry = get_l2_entry(s, l2_table, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(entry);
 
         if (type != wanted_type) {
@@ -415,6 +522,52 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     return i;
 }
 
+/*
+ * For images with extended L2 entries: returns the number of bytes, starting
+ * at subcluster @sc_index of the cluster at @l2_index, that have the same
+ * subcluster type as that subcluster and (if allocated) are stored
+ * contiguously in the image file.  At most @nb_clusters clusters are looked
+ * at.
+ */
+static uint64_t count_contiguous_subclusters(BDRVQcow2State *s,
+                                             int nb_clusters, int sc_index,
+                                             uint64_t *l2_table, int l2_index)
+{
+    uint64_t entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    QCow2ClusterType type =
+        qcow2_get_subcluster_type(s, entry, bitmap, sc_index);
+    uint64_t expected_offset = entry & L2E_OFFSET_MASK;
+    bool check_offset = type == QCOW2_CLUSTER_NORMAL ||
+                        type == QCOW2_CLUSTER_ZERO_ALLOC;
+    uint64_t count = 0;
+    int i, j;
+
+    assert(has_subclusters(s) && type != QCOW2_CLUSTER_COMPRESSED);
+
+    for (i = 0; i < nb_clusters; i++) {
+        entry = get_l2_entry(s, l2_table, l2_index + i);
+        bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+        if ((entry & QCOW_OFLAG_COMPRESSED) ||
+            !qcow2_l2_bitmap_is_valid(entry, bitmap)) {
+            break;
+        }
+        if (check_offset && (entry & L2E_OFFSET_MASK) !=
+            expected_offset + ((uint64_t) i << s->cluster_bits)) {
+            break;
+        }
+        for (j = i ? 0 : sc_index; j < s->subclusters_per_cluster; j++) {
+            if (qcow2_get_subcluster_type(s, entry, bitmap, j) != type) {
+                goto out;
+            }
+            count++;
+        }
+    }
+
+out:
+    return count << s->subcluster_bits;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -516,8 +669,8 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
-    uint64_t l1_index, l2_offset, *l2_table;
-    int l1_bits, c;
+    uint64_t l1_index, l2_offset, *l2_table, l2_bitmap;
+    int l1_bits, c, sc_index;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
     QCow2ClusterType type;
@@ -566,11 +719,14 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         return ret;
     }
+    l2_prefetch(bs, offset);
 
     /* find the cluster offset for the given disk offset */
 
     l2_index = offset_to_l2_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    sc_index = offset_to_sc_index(s, offset);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -578,7 +734,18 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
-    type = qcow2_get_cluster_type(*cluster_offset);
+    if (has_subclusters(s) &&
+        !qcow2_l2_bitmap_is_valid(*cluster_offset, l2_bitmap)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Invalid subcluster "
+                                "bitmap %#" PRIx64 " (L2 offset: %#" PRIx64
+                                ", L2 index: %#x)", l2_bitmap,
+                                l2_offset, l2_index);
+        ret = -EIO;
+        goto fail;
+    }
+
+    type = qcow2_get_subcluster_type(s, *cluster_offset, l2_bitmap,
+                                     sc_index);
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
@@ -590,21 +757,36 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     switch (type) {
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
-        c = 1;
+        bytes_available = s->cluster_size;
         *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(nb_clusters,
-                                                  &l2_table[l2_index], type);
+        if (has_subclusters(s)) {
+            bytes_available = ((uint64_t) sc_index << s->subcluster_bits) +
+                count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                             l2_table, l2_index);
+        } else {
+            c = count_contiguous_clusters_unallocated(s, nb_clusters,
+                                                      l2_table, l2_index,
+                                                      type);
+            bytes_available = (int64_t)c * s->cluster_size;
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            bytes_available = ((uint64_t) sc_index << s->subcluster_bits) +
+                count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                             l2_table, l2_index);
+        } else {
+            c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_ZERO);
+            bytes_available = (int64_t)c * s->cluster_size;
+        }
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
@@ -622,8 +804,6 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
-    bytes_available = (int64_t)c * s->cluster_size;
-
 out:
     if (bytes_available > bytes_needed) {
         bytes_available = bytes_needed;
@@ -690,6 +870,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         if (ret < 0) {
             return ret;
         }
+        l2_prefetch(bs, offset);
     } else {
         /* First allocate a new L2 table (and do COW if needed) */
         ret = l2_allocate(bs, l1_index, &l2_table);
@@ -699,7 +880,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -744,7 +925,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -768,7 +949,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -910,6 +1094,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     int i, j = 0, l2_index, ret;
     uint64_t *old_cluster, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
+    uint64_t written_start, written_end;
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
     assert(m->nb_clusters > 0);
@@ -941,20 +1126,51 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
 
+    /* The area that now holds valid data, relative to m->offset.  With
+     * extended L2 entries, only the subclusters in it become allocated. */
+    written_start = start_of_subcluster(s, m->cow_start.offset);
+    written_end = QEMU_ALIGN_UP(m->cow_end.offset + m->cow_end.nb_bytes,
+                                s->subcluster_size);
+
     assert(l2_index + m->nb_clusters <= s->l2_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
          * The first one to complete updates l2 table with pointer to its
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_table[l2_index + i] != 0) {
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
         }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_table, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits)) |
+                     QCOW_OFLAG_COPIED);
+
+        if (has_subclusters(s)) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+            uint64_t lo = MAX(written_start, cluster_start) - cluster_start;
+            uint64_t hi = MIN(written_end, cluster_start + s->cluster_size)
+                          - cluster_start;
+
+            /* Subclusters of a newly allocated cluster that were not written
+             * to can only keep reading as zeros */
+            if (!m->keep_old_clusters) {
+                bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+            }
+            if (lo < hi) {
+                int sc_lo = lo >> s->subcluster_bits;
+                int sc_hi = hi >> s->subcluster_bits;
+
+                bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(sc_lo, sc_hi);
+                bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(sc_lo, sc_hi);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+        }
      }
 
 
@@ -968,7 +1184,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (!m->keep_old_clusters && j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -990,12 +1206,18 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
+                /* With extended L2 entries, handle_copied() leaves clusters
+                 * with unallocated subclusters to us; those are filled in
+                 * place, one at a time */
+                if (has_subclusters(s) && i == 0) {
+                    i++;
+                }
                 goto out;
             }
             break;
@@ -1042,6 +1264,13 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With extended L2 entries the COW regions of an allocation need not
+         * cover whole clusters, but the L2 entries it updates do */
+        if (has_subclusters(s)) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = QEMU_ALIGN_UP(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -1077,6 +1306,21 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * For images with extended L2 entries: returns true if all subclusters of the
+ * cluster at @l2_index that intersect the byte range [@start, @end) of the
+ * cluster are allocated.
+ */
+static bool subclusters_allocated(BDRVQcow2State *s, uint64_t *l2_table,
+                                  int l2_index, uint64_t start, uint64_t end)
+{
+    uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t mask = QCOW_OFLAG_SUB_ALLOC_RANGE(start >> s->subcluster_bits,
+        ((end - 1) >> s->subcluster_bits) + 1);
+
+    return (bitmap & mask) == mask;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -1133,7 +1377,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1160,11 +1404,34 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
+        /* ...as long as the request only touches allocated subclusters */
+        if (has_subclusters(s)) {
+            uint64_t start = offset_into_cluster(s, guest_offset);
+            uint64_t end = start + *bytes;
+            unsigned int i;
+
+            for (i = 0; i < keep_clusters; i++) {
+                uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+
+                if (!subclusters_allocated(s, l2_table, l2_index + i,
+                        MAX(start, cluster_start) - cluster_start,
+                        MIN(end, cluster_start + s->cluster_size)
+                        - cluster_start)) {
+                    keep_clusters = i;
+                    break;
+                }
+            }
+        }
+
+        if (keep_clusters == 0) {
+            ret = 0;
+            goto out;
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -1261,10 +1528,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcow2State *s = bs->opaque;
     int l2_index;
     uint64_t *l2_table;
-    uint64_t entry;
+    uint64_t entry, first_bitmap;
     uint64_t nb_clusters;
+    QCow2ClusterType type;
     int ret;
     bool keep_old_clusters = false;
+    bool subcluster_cow = false;
 
     uint64_t alloc_cluster_offset = 0;
 
@@ -1289,7 +1558,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
+    first_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    type = qcow2_get_cluster_type(entry);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
@@ -1303,11 +1574,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
-    if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_ZERO_ALLOC &&
+    /* With extended L2 entries, a QCOW2_CLUSTER_NORMAL cluster ends up here
+     * if some of the subclusters we write to are not allocated yet */
+    if ((type == QCOW2_CLUSTER_ZERO_ALLOC ||
+         (has_subclusters(s) && type == QCOW2_CLUSTER_NORMAL)) &&
         (entry & QCOW_OFLAG_COPIED) &&
         (!*host_offset ||
-         start_of_cluster(s, *host_offset) == (entry & L2E_OFFSET_MASK)))
-    {
+         start_of_cluster(s, *host_offset) == (entry & L2E_OFFSET_MASK))) {
         int preallocated_nb_clusters;
 
         if (offset_into_cluster(s, entry & L2E_OFFSET_MASK)) {
@@ -1323,8 +1596,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * would be fine, too, but count_cow_clusters() above has limited
          * nb_clusters already to a range of COW clusters */
         preallocated_nb_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], QCOW_OFLAG_COPIED);
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1335,6 +1608,24 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         keep_old_clusters = true;
     }
 
+    /* With extended L2 entries, only the partially written subclusters need
+     * COW if the clusters have no data outside of them: this is the case for
+     * the cluster reused above and for clusters that were never allocated.
+     * Anything else (compressed clusters, clusters shared with snapshots) is
+     * copied as a whole. */
+    if (has_subclusters(s)) {
+        int i;
+
+        subcluster_cow = true;
+        for (i = 0; !keep_old_clusters && i < nb_clusters; i++) {
+            if (get_l2_entry(s, l2_table, l2_index + i) &
+                (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) {
+                subcluster_cow = false;
+                break;
+            }
+        }
+    }
+
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     if (!alloc_cluster_offset) {
@@ -1381,8 +1672,34 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
     int nb_bytes = MIN(requested_bytes, avail_bytes);
+    int cow_start_offset = 0;
+    int cow_start_bytes = offset_into_cluster(s, guest_offset);
+    int cow_end_bytes = avail_bytes - nb_bytes;
     QCowL2Meta *old_m = *m;
 
+    if (subcluster_cow) {
+        int last_sc = ((nb_bytes - 1) >> s->subcluster_bits) &
+                      (s->subclusters_per_cluster - 1);
+
+        /* Subclusters that are already allocated need no COW.  A reused
+         * cluster is always the only one (see count_cow_clusters()). */
+        if (first_bitmap &
+            QCOW_OFLAG_SUB_ALLOC(offset_to_sc_index(s, guest_offset))) {
+            cow_start_offset = cow_start_bytes;
+        } else {
+            cow_start_offset = start_of_subcluster(s, cow_start_bytes);
+        }
+        cow_start_bytes -= cow_start_offset;
+
+        if (keep_old_clusters &&
+            (first_bitmap & QCOW_OFLAG_SUB_ALLOC(last_sc))) {
+            cow_end_bytes = 0;
+        } else {
+            cow_end_bytes = QEMU_ALIGN_UP(nb_bytes, s->subcluster_size)
+                            - nb_bytes;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1395,12 +1712,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .keep_old_clusters  = keep_old_clusters,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
+            .offset     = cow_start_offset,
+            .nb_bytes   = cow_start_bytes,
         },
         .cow_end = {
             .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
+            .nb_bytes   = cow_end_bytes,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1545,76 +1862,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
-{
-    BDRVQcow2State *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-
-        /* Allocate buffers on first decompress operation, most images are
-         * uncompressed and the memory overhead can be avoided.  The buffers
-         * are freed in .bdrv_close().
-         */
-        if (!s->cluster_data) {
-            /* one more sector for decompressed data alignment */
-            s->cluster_data = qemu_try_blockalign(bs->file->bs,
-                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size + 512);
-            if (!s->cluster_data) {
-                return -ENOMEM;
-            }
-        }
-        if (!s->cluster_cache) {
-            s->cluster_cache = g_malloc(s->cluster_size);
-        }
-
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
-    }
-    return 0;
-}
-
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of discarded
@@ -1642,7 +1889,7 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1659,7 +1906,14 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
          */
         switch (qcow2_get_cluster_type(old_l2_entry)) {
         case QCOW2_CLUSTER_UNALLOCATED:
-            if (full_discard || !bs->backing) {
+            if (has_subclusters(s)) {
+                /* Some subclusters may still read as zeros */
+                uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+                if (full_discard ? bitmap == 0
+                    : !bs->backing || bitmap == QCOW_L2_BITMAP_ALL_ZEROES) {
+                    continue;
+                }
+            } else if (full_discard || !bs->backing) {
                 continue;
             }
             break;
@@ -1681,10 +1935,14 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (!full_discard && s->qcow_version >= 3) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1764,24 +2022,39 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         uint64_t old_offset;
         QCow2ClusterType cluster_type;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
         cluster_type = qcow2_get_cluster_type(old_offset);
-        if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
-            (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
+        if (has_subclusters(s)) {
+            if (get_l2_bitmap(s, l2_table, l2_index + i) ==
+                QCOW_L2_BITMAP_ALL_ZEROES &&
+                (cluster_type == QCOW2_CLUSTER_UNALLOCATED || !unmap)) {
+                continue;
+            }
+        } else if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
+                   (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
             continue;
         }
 
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            if (has_subclusters(s)) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+            } else {
+                set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
+            }
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
-        } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+        } else if (!has_subclusters(s)) {
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
+        }
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
         }
     }
 
@@ -1853,6 +2126,10 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
+    /* Only used for downgrading to compat=0.10, which has no extended L2
+     * entries */
+    assert(!has_subclusters(s));
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
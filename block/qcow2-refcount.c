@@ -872,6 +872,9 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0) {
             void *table;
 
+            qcow2_decompress_cache_invalidate(bs, cluster_offset,
+                                              s->cluster_size);
+
             table = qcow2_cache_is_table_offset(bs, s->refcount_block_cache,
                                                 offset);
             if (table != NULL) {
@@ -1247,7 +1250,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 uint64_t cluster_index;
                 uint64_t offset;
 
-                entry = be64_to_cpu(l2_table[j]);
+                entry = get_l2_entry(s, l2_table, j);
                 old_entry = entry;
                 entry &= ~QCOW_OFLAG_COPIED;
                 offset = entry & L2E_OFFSET_MASK;
@@ -1315,7 +1318,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(entry);
+                    set_l2_entry(s, l2_table, j, entry);
                     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
                                                  l2_table);
                 }
@@ -1497,10 +1500,13 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Number of L2 tables that check_refcounts_l1() reads ahead */
+#define CHECK_L2_READAHEAD 16
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which was read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1508,27 +1514,27 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+            if (!qcow2_l2_bitmap_is_valid(l2_entry, l2_bitmap)) {
+                fprintf(stderr, "ERROR: invalid subcluster bitmap %#" PRIx64
+                        " (L2 offset: %#" PRIx64 ", L2 index: %#x)\n",
+                        l2_bitmap, l2_offset, i);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1549,7 +1555,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                            refcount_table, refcount_table_size,
                                            l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1584,7 +1590,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                            refcount_table, refcount_table_size,
                                            offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1605,12 +1611,38 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+typedef struct CheckL2Read {
+    BlockDriverState *bs;
+    int64_t l2_offset;
+    uint64_t *l2_table;
+    int ret;                /* -EINPROGRESS while the read is in flight */
+    Coroutine *waiter;
+} CheckL2Read;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+    BDRVQcow2State *s = r->bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pread(r->bs->file, r->l2_offset,
+                        s->l2_size * l2_entry_size(s), r->l2_table, 0);
+    r->ret = ret < 0 ? ret : 0;
+    if (r->waiter) {
+        aio_co_wake(r->waiter);
+    }
+}
+
+static void coroutine_fn check_l2_read_wait(CheckL2Read *r)
+{
+    while (r->ret == -EINPROGRESS) {
+        r->waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    r->waiter = NULL;
 }
 
 /*
@@ -1618,19 +1650,24 @@ fail:
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * The L2 tables are read with up to CHECK_L2_READAHEAD requests in flight,
+ * but processed in L1 order so that the results do not depend on timing.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
-static int check_refcounts_l1(BlockDriverState *bs,
-                              BdrvCheckResult *res,
-                              void **refcount_table,
-                              int64_t *refcount_table_size,
-                              int64_t l1_table_offset, int l1_size,
-                              int flags)
+static int coroutine_fn check_refcounts_l1_co(BlockDriverState *bs,
+                                              BdrvCheckResult *res,
+                                              void **refcount_table,
+                                              int64_t *refcount_table_size,
+                                              int64_t l1_table_offset,
+                                              int l1_size, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    CheckL2Read reads[CHECK_L2_READAHEAD] = { { 0 } };
+    int head = 0, tail = 0, in_flight = 0;
+    int i, next, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1659,42 +1696,145 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    for (i = 0; i < CHECK_L2_READAHEAD; i++) {
+        reads[i].l2_table = qemu_try_blockalign(bs->file->bs,
+                                                s->l2_size * l2_entry_size(s));
+        if (!reads[i].l2_table) {
+            ret = -ENOMEM;
+            res->check_errors++;
+            goto fail;
+        }
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = qcow2_inc_refcounts_imrt(bs, res,
-                                           refcount_table, refcount_table_size,
-                                           l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
+    next = 0;
+    for (;;) {
+        CheckL2Read *r;
+
+        /* Keep reading ahead */
+        while (in_flight < CHECK_L2_READAHEAD && next < l1_size) {
+            l2_offset = l1_table[next++];
+            if (!l2_offset) {
+                continue;
             }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+            r = &reads[tail];
+            tail = (tail + 1) % CHECK_L2_READAHEAD;
+            in_flight++;
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
+            r->bs = bs;
+            r->l2_offset = l2_offset & L1E_OFFSET_MASK;
+            r->ret = -EINPROGRESS;
+            qemu_coroutine_enter(qemu_coroutine_create(check_l2_read_entry, r));
+        }
+
+        if (!in_flight) {
+            break;
+        }
+
+        r = &reads[head];
+        check_l2_read_wait(r);
+        head = (head + 1) % CHECK_L2_READAHEAD;
+        in_flight--;
+
+        /* Mark L2 table as used */
+        l2_offset = r->l2_offset;
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
+        }
+
+        if (r->ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            ret = r->ret;
+            goto fail;
+        }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_offset,
+                                 r->l2_table, flags);
+        if (ret < 0) {
+            goto fail;
         }
     }
-    g_free(l1_table);
-    return 0;
+    ret = 0;
 
 fail:
+    /* The buffers must not go away under requests that are still running */
+    while (in_flight) {
+        check_l2_read_wait(&reads[head]);
+        head = (head + 1) % CHECK_L2_READAHEAD;
+        in_flight--;
+    }
+    for (i = 0; i < CHECK_L2_READAHEAD; i++) {
+        qemu_vfree(reads[i].l2_table);
+    }
     g_free(l1_table);
     return ret;
 }
 
+typedef struct CheckL1Co {
+    BlockDriverState *bs;
+    BdrvCheckResult *res;
+    void **refcount_table;
+    int64_t *refcount_table_size;
+    int64_t l1_table_offset;
+    int l1_size;
+    int flags;
+    int ret;
+} CheckL1Co;
+
+static void coroutine_fn check_refcounts_l1_entry(void *opaque)
+{
+    CheckL1Co *c = opaque;
+
+    c->ret = check_refcounts_l1_co(c->bs, c->res, c->refcount_table,
+                                   c->refcount_table_size, c->l1_table_offset,
+                                   c->l1_size, c->flags);
+    bdrv_wakeup(c->bs);
+}
+
+static int check_refcounts_l1(BlockDriverState *bs,
+                              BdrvCheckResult *res,
+                              void **refcount_table,
+                              int64_t *refcount_table_size,
+                              int64_t l1_table_offset, int l1_size,
+                              int flags)
+{
+    Coroutine *co;
+    CheckL1Co c = {
+        .bs                     = bs,
+        .res                    = res,
+        .refcount_table         = refcount_table,
+        .refcount_table_size    = refcount_table_size,
+        .l1_table_offset        = l1_table_offset,
+        .l1_size                = l1_size,
+        .flags                  = flags,
+        .ret                    = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        check_refcounts_l1_entry(&c);
+    } else {
+        co = qemu_coroutine_create(check_refcounts_l1_entry, &c);
+        bdrv_coroutine_enter(bs, co);
+        BDRV_POLL_WHILE(bs, c.ret == -EINPROGRESS);
+    }
+    return c.ret;
+}
+
 /*
  * Checks the OFLAG_COPIED flag for all L1 and L2 entries.
  *
@@ -1749,7 +1889,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1758,7 +1898,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1778,9 +1918,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -2004,9 +2144,65 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
+/* A run of adjacent clusters whose refcounts are repaired by the same amount */
+typedef struct RefcountRepair {
+    int64_t start;
+    int64_t nb_clusters;
+    uint64_t addend;
+    bool decrease;
+    int *num_fixed;
+} RefcountRepair;
+
+static void flush_refcount_repair(BlockDriverState *bs, BdrvCheckResult *res,
+                                  RefcountRepair *repair)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t i;
+    int ret;
+
+    if (!repair->nb_clusters) {
+        return;
+    }
+
+    ret = update_refcount(bs, repair->start << s->cluster_bits,
+                          repair->nb_clusters << s->cluster_bits,
+                          repair->addend, repair->decrease,
+                          QCOW2_DISCARD_ALWAYS);
+    if (ret >= 0) {
+        *repair->num_fixed += repair->nb_clusters;
+        repair->nb_clusters = 0;
+        return;
+    }
+
+    /* update_refcount() tries to undo a failed run, so retry cluster by
+     * cluster to fix as much as possible and to tell which ones failed */
+    for (i = repair->start; i < repair->start + repair->nb_clusters; i++) {
+        ret = update_refcount(bs, i << s->cluster_bits, 1,
+                              repair->addend, repair->decrease,
+                              QCOW2_DISCARD_ALWAYS);
+        if (ret >= 0) {
+            (*repair->num_fixed)++;
+            continue;
+        }
+
+        /* And if we couldn't, print an error */
+        fprintf(stderr, "ERROR could not fix %s of cluster %" PRId64 ": %s\n",
+                repair->decrease ? "leak" : "refcount", i, strerror(-ret));
+        if (repair->decrease) {
+            res->leaks++;
+        } else {
+            res->corruptions++;
+        }
+    }
+    repair->nb_clusters = 0;
+}
+
 /*
  * Compares the actual reference count for each cluster in the image against the
  * refcount as reported by the refcount structures on-disk.
+ *
+ * Repairs are collected into runs of adjacent clusters so that a large number
+ * of leaked clusters does not take an update_refcount() call each.
  */
 static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix, bool *rebuild,
@@ -2014,6 +2210,7 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                               void *refcount_table, int64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    RefcountRepair repair = { 0 };
     int64_t i;
     uint64_t refcount1, refcount2;
     int ret;
@@ -2036,6 +2233,9 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         if (refcount1 != refcount2) {
             /* Check if we're allowed to fix the mismatch */
             int *num_fixed = NULL;
+            uint64_t addend = refcount_diff(refcount1, refcount2);
+            bool decrease = refcount1 > refcount2;
+
             if (refcount1 == 0) {
                 *rebuild = true;
             } else if (refcount1 > refcount2 && (fix & BDRV_FIX_LEAKS)) {
@@ -2052,14 +2252,21 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                    i, refcount1, refcount2);
 
             if (num_fixed) {
-                ret = update_refcount(bs, i << s->cluster_bits, 1,
-                                      refcount_diff(refcount1, refcount2),
-                                      refcount1 > refcount2,
-                                      QCOW2_DISCARD_ALWAYS);
-                if (ret >= 0) {
-                    (*num_fixed)++;
-                    continue;
+                if (repair.nb_clusters &&
+                    (repair.start + repair.nb_clusters != i ||
+                     repair.addend != addend || repair.decrease != decrease)) {
+                    flush_refcount_repair(bs, res, &repair);
                 }
+                if (!repair.nb_clusters) {
+                    repair = (RefcountRepair) {
+                        .start      = i,
+                        .addend     = addend,
+                        .decrease   = decrease,
+                        .num_fixed  = num_fixed,
+                    };
+                }
+                repair.nb_clusters++;
+                continue;
             }
 
             /* And if we couldn't, print an error */
@@ -2070,6 +2277,8 @@ static void compare_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
     }
+
+    flush_refcount_repair(bs, res, &repair);
 }
 
 /*
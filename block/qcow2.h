@@ -64,6 +64,26 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Images with extended L2 entries store a 64-bit bitmap after each standard
+ * L2 entry.  Bits 0-31 mark subclusters as allocated, bits 32-63 mark them as
+ * reading as zeros.  A subcluster with neither bit set is unallocated. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
+/* Size of normal and extended L2 entries */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
+/* Smallest cluster size that may be used with extended L2 entries */
+#define QCOW_EXTL2_MIN_CLUSTER_BITS 14
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
@@ -83,6 +103,15 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of decompressed clusters kept around for compressed images */
+#define QCOW2_DECOMPRESS_CACHE_SIZE 16
+
+/* Maximum number of thread pool workers used for (de)compression per image */
+#define QCOW2_MAX_COMPRESS_THREADS 8
+
+/* zstd compression level for compression_type=zstd */
+#define QCOW2_ZSTD_LEVEL 3
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -125,6 +154,12 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Only present if header_length is large enough; zlib otherwise */
+    uint8_t compression_type;
+
+    /* header must be a multiple of 8 */
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -188,13 +223,19 @@ enum {
 
 /* Incompatible feature bits */
 enum {
-    QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
-    QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
-    QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
-    QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
-
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+    QCOW2_INCOMPAT_DIRTY_BITNR       = 0,
+    QCOW2_INCOMPAT_CORRUPT_BITNR     = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR       = 4,
+    QCOW2_INCOMPAT_DIRTY             = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_CORRUPT           = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION       = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2             = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+
+    QCOW2_INCOMPAT_MASK              = QCOW2_INCOMPAT_DIRTY
+                                     | QCOW2_INCOMPAT_CORRUPT
+                                     | QCOW2_INCOMPAT_COMPRESSION
+                                     | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -240,6 +281,13 @@ typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
                                   uint64_t index, uint64_t value);
 
+typedef struct Qcow2DecompressedCluster {
+    uint64_t offset;      /* host offset of the compressed data, or -1 */
+    uint64_t size;        /* size of the compressed data */
+    uint64_t lru_counter;
+    uint8_t *data;
+} Qcow2DecompressedCluster;
+
 typedef struct Qcow2BitmapHeaderExt {
     uint32_t nb_bitmaps;
     uint32_t reserved32;
@@ -253,6 +301,9 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int subcluster_bits;
+    int subcluster_size;
+    int subclusters_per_cluster;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -265,12 +316,21 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+
+    /* Sequential access detection for L2 table prefetch: the guest offset
+     * of the last lookup, and the L1 index below which tables were
+     * prefetched already */
+    uint64_t l2_prefetch_last_offset;
+    uint64_t l2_prefetch_end;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2DecompressedCluster decompress_cache[QCOW2_DECOMPRESS_CACHE_SIZE];
+    uint64_t decompress_lru_counter;
+    uint64_t decompress_cache_generation;
+    int nb_compress_threads;
+    CoQueue compress_wait_queue;
+    Qcow2CompressionType compression_type;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -468,6 +528,59 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) & (s->subclusters_per_cluster - 1);
+}
+
+static inline int64_t start_of_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & ~(s->subcluster_size - 1);
+}
+
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_table[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_table[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_table[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_table[idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -500,6 +613,51 @@ static inline QCow2ClusterType qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster @sc_index of a cluster, reusing the cluster
+ * types: for images with extended L2 entries, a subcluster of an allocated
+ * cluster may be QCOW2_CLUSTER_NORMAL, QCOW2_CLUSTER_ZERO_ALLOC or
+ * QCOW2_CLUSTER_UNALLOCATED.  Without extended L2 entries this is the type of
+ * the whole cluster.
+ */
+static inline QCow2ClusterType qcow2_get_subcluster_type(BDRVQcow2State *s,
+                                                         uint64_t l2_entry,
+                                                         uint64_t l2_bitmap,
+                                                         int sc_index)
+{
+    if (!has_subclusters(s) || (l2_entry & QCOW_OFLAG_COMPRESSED)) {
+        return qcow2_get_cluster_type(l2_entry);
+    }
+
+    if (l2_entry & L2E_OFFSET_MASK) {
+        if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+            return QCOW2_CLUSTER_NORMAL;
+        } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+            return QCOW2_CLUSTER_ZERO_ALLOC;
+        }
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO_PLAIN;
+    }
+    return QCOW2_CLUSTER_UNALLOCATED;
+}
+
+/* Checks an extended L2 entry for bitmap bits that must not be set */
+static inline bool qcow2_l2_bitmap_is_valid(uint64_t l2_entry,
+                                            uint64_t l2_bitmap)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return l2_bitmap == 0;
+    }
+    if (l2_entry & QCOW_OFLAG_ZERO) {
+        return false;
+    }
+    if (!(l2_entry & L2E_OFFSET_MASK) &&
+        (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)) {
+        return false;
+    }
+    return !(l2_bitmap & (l2_bitmap >> 32) & QCOW_L2_BITMAP_ALL_ALLOC);
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -539,6 +697,8 @@ int qcow2_mark_dirty(BlockDriverState *bs);
 int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
 int qcow2_update_header(BlockDriverState *bs);
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t length);
 
 void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
                              int64_t size, const char *message_format, ...)
@@ -598,7 +758,6 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
@@ -658,6 +817,10 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+int qcow2_cache_get_size(Qcow2Cache *c);
+uint64_t qcow2_cache_get_generation(Qcow2Cache *c);
+void qcow2_cache_insert(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+                        const void *table, uint64_t generation);
 void *qcow2_cache_is_table_offset(BlockDriverState *bs, Qcow2Cache *c,
                                   uint64_t offset);
 void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, void *table);
@@ -0,0 +1,534 @@
+/*
+ * In-memory copy-on-write overlay block driver
+ *
+ * Writes are kept in RAM, reads of data that was never written are passed to
+ * a read-only base image.  All overlay state can be dropped at once with the
+ * ram-overlay-reset QMP command, which makes the node look like the base
+ * image again.  The max-size option limits the memory used for overlay data;
+ * once it is reached, writes that need a new chunk fail with -ENOSPC.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/option.h"
+#include "qemu/coroutine.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qmp-commands.h"
+
+#define RAM_OVERLAY_CHUNK_SIZE (64 * 1024)
+
+#define RAM_OVERLAY_OPT_MAX_SIZE "max-size"
+
+typedef struct RamOverlayChunk {
+    uint64_t index;
+    /* NULL for a chunk that reads as zeroes */
+    uint8_t *data;
+
+    /* Set once data holds the base image contents (or is about to be
+     * overwritten completely).  Until then, writers to the same chunk wait
+     * on populate_queue. */
+    bool populated;
+    CoQueue populate_queue;
+} RamOverlayChunk;
+
+typedef struct BDRVRamOverlayState {
+    int64_t length;
+
+    /* Chunk index -> RamOverlayChunk for every chunk written since open or
+     * since the last reset */
+    GTree *chunks;
+
+    /* Number of chunks in chunks that have a data buffer, and the limit for
+     * it derived from max-size (0 means unlimited) */
+    uint64_t nb_data_chunks;
+    uint64_t max_data_chunks;
+} BDRVRamOverlayState;
+
+static BlockDriver bdrv_ram_overlay;
+
+static QemuOptsList runtime_opts = {
+    .name = "ram-overlay",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = RAM_OVERLAY_OPT_MAX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum memory used for overlay data "
+                    "(0 means unlimited)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static gint ram_overlay_chunk_cmp(gconstpointer a, gconstpointer b,
+                                  gpointer opaque)
+{
+    uint64_t ia = *(const uint64_t *)a;
+    uint64_t ib = *(const uint64_t *)b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+static void ram_overlay_chunk_free(gpointer opaque)
+{
+    RamOverlayChunk *chunk = opaque;
+
+    qemu_vfree(chunk->data);
+    g_free(chunk);
+}
+
+static GTree *ram_overlay_new_tree(void)
+{
+    return g_tree_new_full(ram_overlay_chunk_cmp, NULL, NULL,
+                           ram_overlay_chunk_free);
+}
+
+static void ram_overlay_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   const BdrvChildRole *role,
+                                   BlockReopenQueue *reopen_queue,
+                                   uint64_t perm, uint64_t shared,
+                                   uint64_t *nperm, uint64_t *nshared)
+{
+    /* Writes never reach the base image, so any number of overlays can share
+     * it as long as nobody modifies it underneath them */
+    *nperm = BLK_PERM_CONSENT_READ;
+    *nshared = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int ram_overlay_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t max_size;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &error_abort);
+    max_size = qemu_opt_get_size(opts, RAM_OVERLAY_OPT_MAX_SIZE, 0);
+    qemu_opts_del(opts);
+
+    if (max_size && max_size < RAM_OVERLAY_CHUNK_SIZE) {
+        error_setg(errp, "max-size must be 0 or at least %d",
+                   RAM_OVERLAY_CHUNK_SIZE);
+        return -EINVAL;
+    }
+    s->max_data_chunks = max_size / RAM_OVERLAY_CHUNK_SIZE;
+
+    /* Unless the base is an existing node, open it read-only */
+    if (!qdict_haskey(options, "file")) {
+        qdict_set_default_str(options, "file." BDRV_OPT_READ_ONLY, "on");
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    s->length = bdrv_getlength(bs->file->bs);
+    if (s->length < 0) {
+        error_setg_errno(errp, -s->length, "Could not get base image size");
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+        return s->length;
+    }
+
+    s->chunks = ram_overlay_new_tree();
+    s->nb_data_chunks = 0;
+    return 0;
+}
+
+static void ram_overlay_close(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    g_tree_destroy(s->chunks);
+}
+
+static int ram_overlay_reopen_prepare(BDRVReopenState *reopen_state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t ram_overlay_getlength(BlockDriverState *bs)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    return s->length;
+}
+
+static RamOverlayChunk *ram_overlay_find_chunk(BDRVRamOverlayState *s,
+                                               uint64_t index)
+{
+    RamOverlayChunk *chunk = g_tree_lookup(s->chunks, &index);
+
+    return chunk && chunk->populated ? chunk : NULL;
+}
+
+/* Allocates the data buffer of a chunk, honouring max-size */
+static int ram_overlay_alloc_data(BlockDriverState *bs,
+                                  RamOverlayChunk *chunk)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+
+    if (s->max_data_chunks && s->nb_data_chunks >= s->max_data_chunks) {
+        return -ENOSPC;
+    }
+    chunk->data = qemu_try_blockalign(bs->file->bs, RAM_OVERLAY_CHUNK_SIZE);
+    if (!chunk->data) {
+        return -ENOMEM;
+    }
+    s->nb_data_chunks++;
+    return 0;
+}
+
+static void ram_overlay_free_data(BDRVRamOverlayState *s,
+                                  RamOverlayChunk *chunk)
+{
+    if (chunk->data) {
+        qemu_vfree(chunk->data);
+        chunk->data = NULL;
+        s->nb_data_chunks--;
+    }
+}
+
+/*
+ * Returns the chunk with the given index in *@pchunk, creating it if
+ * necessary, with a data buffer.  A new chunk is filled from the base image
+ * unless @overwrite is true, in which case the caller must overwrite all of
+ * it before yielding.
+ */
+static int coroutine_fn ram_overlay_get_chunk(BlockDriverState *bs,
+                                              uint64_t index, bool overwrite,
+                                              RamOverlayChunk **pchunk)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t offset = index * RAM_OVERLAY_CHUNK_SIZE;
+    RamOverlayChunk *chunk;
+    int64_t bytes;
+    int ret;
+
+    while ((chunk = g_tree_lookup(s->chunks, &index)) && !chunk->populated) {
+        qemu_co_queue_wait(&chunk->populate_queue, NULL);
+    }
+    if (chunk) {
+        if (!chunk->data) {
+            /* A zero chunk is about to be written */
+            ret = ram_overlay_alloc_data(bs, chunk);
+            if (ret < 0) {
+                return ret;
+            }
+            if (!overwrite) {
+                memset(chunk->data, 0, RAM_OVERLAY_CHUNK_SIZE);
+            }
+        }
+        *pchunk = chunk;
+        return 0;
+    }
+
+    chunk = g_new0(RamOverlayChunk, 1);
+    chunk->index = index;
+    ret = ram_overlay_alloc_data(bs, chunk);
+    if (ret < 0) {
+        g_free(chunk);
+        return ret;
+    }
+    qemu_co_queue_init(&chunk->populate_queue);
+    g_tree_insert(s->chunks, &chunk->index, chunk);
+
+    if (!overwrite) {
+        bytes = MIN(RAM_OVERLAY_CHUNK_SIZE, s->length - offset);
+        ret = bdrv_co_pread(bs->file, offset, bytes, chunk->data, 0);
+        if (ret < 0) {
+            /* Waiters look the chunk up again and retry the read */
+            qemu_co_queue_restart_all(&chunk->populate_queue);
+            ram_overlay_free_data(s, chunk);
+            g_tree_remove(s->chunks, &index);
+            return ret;
+        }
+        memset(chunk->data + bytes, 0, RAM_OVERLAY_CHUNK_SIZE - bytes);
+    }
+
+    chunk->populated = true;
+    qemu_co_queue_restart_all(&chunk->populate_queue);
+
+    *pchunk = chunk;
+    return 0;
+}
+
+static int coroutine_fn ram_overlay_co_preadv(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    QEMUIOVector base_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&base_qiov, qiov->niov);
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t index = pos / RAM_OVERLAY_CHUNK_SIZE;
+        uint64_t in_chunk = pos % RAM_OVERLAY_CHUNK_SIZE;
+        uint64_t n = MIN(bytes - bytes_done, RAM_OVERLAY_CHUNK_SIZE - in_chunk);
+        RamOverlayChunk *chunk = ram_overlay_find_chunk(s, index);
+
+        if (chunk) {
+            if (chunk->data) {
+                qemu_iovec_from_buf(qiov, bytes_done, chunk->data + in_chunk,
+                                    n);
+            } else {
+                qemu_iovec_memset(qiov, bytes_done, 0, n);
+            }
+            bytes_done += n;
+            continue;
+        }
+
+        /* Read the whole run of chunks that are not in the overlay at once */
+        while (bytes_done + n < bytes &&
+               !ram_overlay_find_chunk(s, (pos + n) / RAM_OVERLAY_CHUNK_SIZE)) {
+            n += MIN(bytes - bytes_done - n, RAM_OVERLAY_CHUNK_SIZE);
+        }
+
+        qemu_iovec_reset(&base_qiov);
+        qemu_iovec_concat(&base_qiov, qiov, bytes_done, n);
+        ret = bdrv_co_preadv(bs->file, pos, n, &base_qiov, 0);
+        if (ret < 0) {
+            break;
+        }
+        bytes_done += n;
+    }
+
+    qemu_iovec_destroy(&base_qiov);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn ram_overlay_co_pwritev(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t bytes_done = 0;
+    int ret;
+
+    /* The overlay has the size of the base image and cannot grow */
+    if (offset + bytes > s->length) {
+        return -ENOSPC;
+    }
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t in_chunk = pos % RAM_OVERLAY_CHUNK_SIZE;
+        uint64_t n = MIN(bytes - bytes_done, RAM_OVERLAY_CHUNK_SIZE - in_chunk);
+        RamOverlayChunk *chunk;
+
+        ret = ram_overlay_get_chunk(bs, pos / RAM_OVERLAY_CHUNK_SIZE,
+                                    n == RAM_OVERLAY_CHUNK_SIZE, &chunk);
+        if (ret < 0) {
+            return ret;
+        }
+
+        qemu_iovec_to_buf(qiov, bytes_done, chunk->data + in_chunk, n);
+        bytes_done += n;
+    }
+
+    return 0;
+}
+
+/* Turns the chunk with the given index into a zero chunk, freeing its data */
+static void coroutine_fn ram_overlay_zero_chunk(BlockDriverState *bs,
+                                                uint64_t index)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    RamOverlayChunk *chunk;
+
+    while ((chunk = g_tree_lookup(s->chunks, &index)) && !chunk->populated) {
+        qemu_co_queue_wait(&chunk->populate_queue, NULL);
+    }
+    if (chunk) {
+        ram_overlay_free_data(s, chunk);
+        return;
+    }
+
+    chunk = g_new0(RamOverlayChunk, 1);
+    chunk->index = index;
+    chunk->populated = true;
+    qemu_co_queue_init(&chunk->populate_queue);
+    g_tree_insert(s->chunks, &chunk->index, chunk);
+}
+
+static int coroutine_fn ram_overlay_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset, int bytes,
+                                                     BdrvRequestFlags flags)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    int64_t bytes_done = 0;
+    int ret;
+
+    if (offset + bytes > s->length) {
+        return -ENOSPC;
+    }
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t index = pos / RAM_OVERLAY_CHUNK_SIZE;
+        uint64_t in_chunk = pos % RAM_OVERLAY_CHUNK_SIZE;
+        uint64_t n = MIN(bytes - bytes_done, RAM_OVERLAY_CHUNK_SIZE - in_chunk);
+        RamOverlayChunk *chunk;
+
+        if (n == RAM_OVERLAY_CHUNK_SIZE) {
+            ram_overlay_zero_chunk(bs, index);
+        } else {
+            ret = ram_overlay_get_chunk(bs, index, false, &chunk);
+            if (ret < 0) {
+                return ret;
+            }
+            memset(chunk->data + in_chunk, 0, n);
+        }
+        bytes_done += n;
+    }
+
+    return 0;
+}
+
+/* Discarded chunks read as zeroes and give their memory back; partial chunks
+ * are left alone */
+static int coroutine_fn ram_overlay_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int bytes)
+{
+    uint64_t index = DIV_ROUND_UP(offset, RAM_OVERLAY_CHUNK_SIZE);
+    uint64_t end = (offset + bytes) / RAM_OVERLAY_CHUNK_SIZE;
+
+    for (; index < end; index++) {
+        ram_overlay_zero_chunk(bs, index);
+    }
+    return 0;
+}
+
+/* Overlay data lives in memory only, there is nothing to write back */
+static int coroutine_fn ram_overlay_co_flush_to_disk(BlockDriverState *bs)
+{
+    return 0;
+}
+
+typedef enum RamOverlayChunkState {
+    RAM_OVERLAY_CHUNK_BASE,
+    RAM_OVERLAY_CHUNK_DATA,
+    RAM_OVERLAY_CHUNK_ZERO,
+} RamOverlayChunkState;
+
+static RamOverlayChunkState ram_overlay_chunk_state(BDRVRamOverlayState *s,
+                                                    uint64_t index)
+{
+    RamOverlayChunk *chunk = g_tree_lookup(s->chunks, &index);
+
+    if (!chunk) {
+        return RAM_OVERLAY_CHUNK_BASE;
+    }
+    return chunk->data || !chunk->populated ? RAM_OVERLAY_CHUNK_DATA
+                                            : RAM_OVERLAY_CHUNK_ZERO;
+}
+
+static int64_t coroutine_fn ram_overlay_co_get_block_status(
+    BlockDriverState *bs, int64_t sector_num, int nb_sectors, int *pnum,
+    BlockDriverState **file)
+{
+    BDRVRamOverlayState *s = bs->opaque;
+    uint64_t start = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t end = (sector_num + nb_sectors) * BDRV_SECTOR_SIZE;
+    uint64_t index = start / RAM_OVERLAY_CHUNK_SIZE;
+    uint64_t pos = (index + 1) * RAM_OVERLAY_CHUNK_SIZE;
+    RamOverlayChunkState state = ram_overlay_chunk_state(s, index);
+
+    while (pos < end &&
+           ram_overlay_chunk_state(s, pos / RAM_OVERLAY_CHUNK_SIZE) == state) {
+        pos += RAM_OVERLAY_CHUNK_SIZE;
+    }
+    *pnum = (MIN(pos, end) - start) / BDRV_SECTOR_SIZE;
+
+    switch (state) {
+    case RAM_OVERLAY_CHUNK_BASE:
+        *file = bs->file->bs;
+        return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | start;
+    case RAM_OVERLAY_CHUNK_DATA:
+        return BDRV_BLOCK_DATA;
+    default:
+        return BDRV_BLOCK_ZERO;
+    }
+}
+
+static int ram_overlay_destroy_chunks(void *opaque)
+{
+    g_tree_destroy(opaque);
+    return 0;
+}
+
+void qmp_ram_overlay_reset(const char *node_name, Error **errp)
+{
+    BlockDriverState *bs;
+    BDRVRamOverlayState *s;
+    AioContext *aio_context;
+    GTree *old_chunks;
+
+    bs = bdrv_find_node(node_name);
+    if (!bs) {
+        error_setg(errp, "Device '%s' not found", node_name);
+        return;
+    }
+    if (bs->drv != &bdrv_ram_overlay) {
+        error_setg(errp, "Node '%s' is not a ram-overlay node", node_name);
+        return;
+    }
+    s = bs->opaque;
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    bdrv_drained_begin(bs);
+    old_chunks = s->chunks;
+    s->chunks = ram_overlay_new_tree();
+    s->nb_data_chunks = 0;
+    bdrv_drained_end(bs);
+
+    /* Nothing references the old chunks any more; free them in the
+     * background so that the reset does not depend on their number */
+    thread_pool_submit_aio(aio_get_thread_pool(aio_context),
+                           ram_overlay_destroy_chunks, old_chunks,
+                           NULL, NULL);
+
+    aio_context_release(aio_context);
+}
+
+static BlockDriver bdrv_ram_overlay = {
+    .format_name                = "ram-overlay",
+    .protocol_name              = "ram-overlay",
+    .instance_size              = sizeof(BDRVRamOverlayState),
+
+    .bdrv_file_open             = ram_overlay_open,
+    .bdrv_close                 = ram_overlay_close,
+    .bdrv_reopen_prepare        = ram_overlay_reopen_prepare,
+    .bdrv_child_perm            = ram_overlay_child_perm,
+
+    .bdrv_getlength             = ram_overlay_getlength,
+
+    .bdrv_co_preadv             = ram_overlay_co_preadv,
+    .bdrv_co_pwritev            = ram_overlay_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = ram_overlay_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = ram_overlay_co_pdiscard,
+    .bdrv_co_flush_to_disk      = ram_overlay_co_flush_to_disk,
+    .bdrv_co_get_block_status   = ram_overlay_co_get_block_status,
+};
+
+static void bdrv_ram_overlay_init(void)
+{
+    bdrv_register(&bdrv_ram_overlay);
+}
+
+block_init(bdrv_ram_overlay_init);
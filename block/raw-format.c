@@ -286,6 +286,54 @@ static int coroutine_fn raw_co_pdiscard(BlockDriverState *bs,
     return bdrv_co_pdiscard(bs->file->bs, offset, bytes);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               BdrvChild *src,
+                                               int64_t src_offset,
+                                               BdrvChild *dst,
+                                               int64_t dst_offset,
+                                               unsigned int bytes,
+                                               BdrvRequestFlags read_flags,
+                                               BdrvRequestFlags write_flags)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (src_offset > INT64_MAX - s->offset) {
+        return -EINVAL;
+    }
+    return bdrv_co_copy_range_from(bs->file, src_offset + s->offset,
+                                   dst, dst_offset, bytes,
+                                   read_flags, write_flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BdrvChild *src,
+                                             int64_t src_offset,
+                                             BdrvChild *dst,
+                                             int64_t dst_offset,
+                                             unsigned int bytes,
+                                             BdrvRequestFlags read_flags,
+                                             BdrvRequestFlags write_flags)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->has_size &&
+        (dst_offset > s->size || bytes > (s->size - dst_offset))) {
+        return -ENOSPC;
+    }
+    if (dst_offset > INT64_MAX - s->offset) {
+        return -EINVAL;
+    }
+
+    /* The data cannot be checked like in raw_co_pwritev() */
+    if (bs->probed && dst_offset < BLOCK_PROBE_BUF_SIZE) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range_to(src, src_offset, bs->file,
+                                 dst_offset + s->offset, bytes,
+                                 read_flags, write_flags);
+}
+
 static int64_t raw_getlength(BlockDriverState *bs)
 {
     int64_t len;
@@ -472,6 +520,18 @@ static int raw_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
     return 0;
 }
 
+static int raw_get_read_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int64_t *host_offset)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (offset > INT64_MAX - s->offset) {
+        return -EINVAL;
+    }
+    return bdrv_get_read_fd(bs->file->bs, offset + s->offset, bytes,
+                            host_offset);
+}
+
 static int raw_probe_geometry(BlockDriverState *bs, HDGeometry *geo)
 {
     BDRVRawState *s = bs->opaque;
@@ -496,12 +556,15 @@ BlockDriver bdrv_raw = {
     .bdrv_co_pwritev      = &raw_co_pwritev,
     .bdrv_co_pwrite_zeroes = &raw_co_pwrite_zeroes,
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = &raw_co_copy_range_to,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
     .bdrv_measure         = &raw_measure,
     .bdrv_get_info        = &raw_get_info,
+    .bdrv_get_read_fd     = &raw_get_read_fd,
     .bdrv_refresh_limits  = &raw_refresh_limits,
     .bdrv_probe_blocksizes = &raw_probe_blocksizes,
     .bdrv_probe_geometry  = &raw_probe_geometry,
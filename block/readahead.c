@@ -0,0 +1,550 @@
+/*
+ * Readahead filter block driver
+ *
+ * Detects sequential read streams and reads ahead of them asynchronously,
+ * so that high-latency images (http, nbd, compressed qcow2, ...) do not pay
+ * a full round trip for every request of a sequential scan.  Each stream
+ * reads ahead in windows that double from READAHEAD_MIN_WINDOW up to the
+ * configured window-size; at most two windows per stream are buffered.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/option.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define READAHEAD_OPT_WINDOW_SIZE       "window-size"
+#define READAHEAD_OPT_STREAMS           "streams"
+
+#define READAHEAD_DEFAULT_WINDOW_SIZE   (1024 * 1024)
+#define READAHEAD_MIN_WINDOW            (128 * 1024)
+#define READAHEAD_MAX_WINDOW_SIZE       (32 * 1024 * 1024)
+#define READAHEAD_DEFAULT_STREAMS       4
+#define READAHEAD_MAX_STREAMS           64
+
+/* Number of back-to-back reads after which a stream counts as sequential */
+#define READAHEAD_MIN_SEQUENTIAL        2
+
+typedef struct ReadaheadStream ReadaheadStream;
+
+typedef struct ReadaheadBuffer {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    uint8_t *data;
+    int ret;                    /* -EINPROGRESS while being read */
+
+    /* Dropped from its stream because it was consumed or overwritten; it
+     * is freed once the read is done and nobody copies from it any more */
+    bool dropped;
+
+    unsigned users;
+    CoQueue wait_queue;
+    QTAILQ_ENTRY(ReadaheadBuffer) next;
+} ReadaheadBuffer;
+
+struct ReadaheadStream {
+    uint64_t next_offset;       /* where the next sequential read starts */
+    uint64_t ra_end;            /* end of the data read ahead so far */
+    uint64_t window;            /* size of the next read ahead */
+    unsigned seq_reads;
+    uint64_t last_used;
+
+    /* Sorted by offset, not overlapping */
+    QTAILQ_HEAD(, ReadaheadBuffer) buffers;
+};
+
+typedef struct BDRVReadaheadState {
+    uint64_t max_window;
+    unsigned nb_streams;
+    ReadaheadStream *streams;
+    uint64_t clock;
+
+    /* The image and its write generation when the node was drained */
+    bool drained;
+    BlockDriverState *drained_file;
+    unsigned int drained_write_gen;
+} BDRVReadaheadState;
+
+static QemuOptsList runtime_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READAHEAD_OPT_WINDOW_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum number of bytes read ahead at once",
+        },
+        {
+            .name = READAHEAD_OPT_STREAMS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sequential streams that are tracked",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void readahead_buffer_free_if_unused(ReadaheadBuffer *buf)
+{
+    if (buf->dropped && !buf->users && buf->ret != -EINPROGRESS) {
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
+static void readahead_drop_buffer(ReadaheadStream *st, ReadaheadBuffer *buf)
+{
+    QTAILQ_REMOVE(&st->buffers, buf, next);
+    buf->dropped = true;
+    readahead_buffer_free_if_unused(buf);
+}
+
+/* Drop all data that a stream read ahead, so that it reads ahead from where
+ * it is again */
+static void readahead_drop_buffers(ReadaheadStream *st)
+{
+    ReadaheadBuffer *buf, *next_buf;
+
+    QTAILQ_FOREACH_SAFE(buf, &st->buffers, next, next_buf) {
+        readahead_drop_buffer(st, buf);
+    }
+    st->ra_end = st->next_offset;
+}
+
+static void readahead_reset_stream(BDRVReadaheadState *s, ReadaheadStream *st,
+                                   uint64_t next_offset)
+{
+    readahead_drop_buffers(st);
+
+    st->next_offset = next_offset;
+    st->ra_end = next_offset;
+    st->window = MIN(READAHEAD_MIN_WINDOW, s->max_window);
+    st->seq_reads = 1;
+}
+
+/* Drop buffered data that overlaps a range that was written.  Buffers
+ * after it are dropped as well, so that the stream reads ahead from the
+ * overwritten part again. */
+static void readahead_invalidate(BDRVReadaheadState *s, uint64_t offset,
+                                 uint64_t bytes)
+{
+    ReadaheadBuffer *buf, *next_buf;
+    unsigned i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        ReadaheadStream *st = &s->streams[i];
+
+        QTAILQ_FOREACH(buf, &st->buffers, next) {
+            if (buf->offset < offset + bytes &&
+                offset < buf->offset + buf->bytes) {
+                break;
+            }
+        }
+        if (!buf) {
+            continue;
+        }
+
+        st->ra_end = MAX(st->next_offset, buf->offset);
+        for (; buf; buf = next_buf) {
+            next_buf = QTAILQ_NEXT(buf, next);
+            readahead_drop_buffer(st, buf);
+        }
+    }
+}
+
+/*
+ * Find the stream that a read continues, or start a new one in place of
+ * the least recently used stream.  A read continues a stream if it starts
+ * at or after the end of the previous read, but not beyond the data that
+ * was read ahead.
+ */
+static ReadaheadStream *readahead_find_stream(BDRVReadaheadState *s,
+                                              uint64_t offset, uint64_t bytes)
+{
+    ReadaheadStream *st, *lru = NULL;
+    unsigned i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        st = &s->streams[i];
+        if (st->seq_reads &&
+            offset + bytes > st->next_offset &&
+            offset <= MAX(st->ra_end, st->next_offset)) {
+            st->seq_reads++;
+            st->next_offset = offset + bytes;
+            st->last_used = ++s->clock;
+            return st;
+        }
+        if (!lru || st->last_used < lru->last_used) {
+            lru = st;
+        }
+    }
+
+    trace_readahead_new_stream(s, offset);
+    readahead_reset_stream(s, lru, offset + bytes);
+    lru->last_used = ++s->clock;
+    return lru;
+}
+
+static void coroutine_fn readahead_co_fetch_entry(void *opaque)
+{
+    ReadaheadBuffer *buf = opaque;
+    BlockDriverState *bs = buf->bs;
+    int ret;
+
+    ret = bdrv_co_pread(bs->file, buf->offset, buf->bytes, buf->data, 0);
+    buf->ret = ret < 0 ? ret : 0;
+
+    qemu_co_queue_restart_all(&buf->wait_queue);
+    readahead_buffer_free_if_unused(buf);
+    bdrv_dec_in_flight(bs);
+}
+
+/* Start reading ahead of a sequential stream, unless enough of it is
+ * buffered already */
+static void readahead_fetch(BlockDriverState *bs, ReadaheadStream *st)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int64_t length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    ReadaheadBuffer *buf;
+    Coroutine *co;
+
+    if (st->seq_reads < READAHEAD_MIN_SEQUENTIAL) {
+        return;
+    }
+
+    /* The stream overtook the read ahead */
+    st->ra_end = MAX(st->ra_end, st->next_offset);
+
+    /* Read ahead once the stream gets into the last window, so that the
+     * next one arrives before it is needed */
+    if (st->ra_end - st->next_offset >= st->window || st->ra_end >= length) {
+        return;
+    }
+
+    buf = g_new0(ReadaheadBuffer, 1);
+    buf->bs = bs;
+    buf->offset = st->ra_end;
+    buf->bytes = MIN(st->window, length - st->ra_end);
+    buf->data = qemu_try_blockalign(bs->file->bs, buf->bytes);
+    if (!buf->data) {
+        g_free(buf);
+        return;
+    }
+    buf->ret = -EINPROGRESS;
+    qemu_co_queue_init(&buf->wait_queue);
+    QTAILQ_INSERT_TAIL(&st->buffers, buf, next);
+
+    trace_readahead_fetch(s, buf->offset, buf->bytes);
+    st->ra_end += buf->bytes;
+    st->window = MIN(st->window * 2, s->max_window);
+
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(readahead_co_fetch_entry, buf);
+    bdrv_coroutine_enter(bs, co);
+}
+
+static ReadaheadBuffer *readahead_find_buffer(ReadaheadStream *st,
+                                              uint64_t offset,
+                                              uint64_t *next_start)
+{
+    ReadaheadBuffer *buf;
+
+    QTAILQ_FOREACH(buf, &st->buffers, next) {
+        if (offset < buf->offset) {
+            *next_start = buf->offset;
+            return NULL;
+        }
+        if (offset < buf->offset + buf->bytes) {
+            return buf;
+        }
+    }
+    *next_start = UINT64_MAX;
+    return NULL;
+}
+
+/* Copy buffered data to @qiov.  Returns the number of bytes copied, or 0
+ * if the buffer cannot be used. */
+static uint64_t coroutine_fn readahead_copy(ReadaheadBuffer *buf,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            uint64_t qiov_offset)
+{
+    uint64_t n = 0;
+
+    buf->users++;
+    while (buf->ret == -EINPROGRESS) {
+        qemu_co_queue_wait(&buf->wait_queue, NULL);
+    }
+
+    /* Data is still valid if the buffer was dropped because the stream
+     * went past it, but not if it was overwritten.  Both cases are treated
+     * alike to keep things simple. */
+    if (buf->ret == 0 && !buf->dropped) {
+        n = MIN(bytes, buf->offset + buf->bytes - offset);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            buf->data + (offset - buf->offset), n);
+    }
+
+    buf->users--;
+    readahead_buffer_free_if_unused(buf);
+    return n;
+}
+
+static int coroutine_fn readahead_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *st;
+    ReadaheadBuffer *buf, *next_buf;
+    QEMUIOVector local_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    st = readahead_find_stream(s, offset, bytes);
+    readahead_fetch(bs, st);
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
+    while (bytes_done < bytes) {
+        uint64_t pos = offset + bytes_done;
+        uint64_t next_start, n;
+
+        buf = readahead_find_buffer(st, pos, &next_start);
+        if (buf) {
+            /* The buffer may be freed by readahead_copy() */
+            next_start = buf->offset + buf->bytes;
+            n = readahead_copy(buf, pos, bytes - bytes_done, qiov, bytes_done);
+            if (n) {
+                trace_readahead_hit(s, pos, n);
+                bytes_done += n;
+                continue;
+            }
+        }
+
+        /* Read the part that is not buffered from the image */
+        n = MIN(bytes - bytes_done, next_start - pos);
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, n);
+        ret = bdrv_co_preadv(bs->file, pos, n, &local_qiov, flags);
+        if (ret < 0) {
+            break;
+        }
+        bytes_done += n;
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+
+    /* Buffers that the stream went past are not needed any more */
+    QTAILQ_FOREACH_SAFE(buf, &st->buffers, next, next_buf) {
+        if (buf->offset + buf->bytes > st->next_offset) {
+            break;
+        }
+        readahead_drop_buffer(st, buf);
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn readahead_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file->bs, offset, bytes);
+    readahead_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static void readahead_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                 const BdrvChildRole *role,
+                                 BlockReopenQueue *reopen_queue,
+                                 uint64_t perm, uint64_t shared,
+                                 uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+
+    /* Buffered data would go stale if somebody else wrote to the image */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t window, streams;
+    unsigned i;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    window = qemu_opt_get_size(opts, READAHEAD_OPT_WINDOW_SIZE,
+                               READAHEAD_DEFAULT_WINDOW_SIZE);
+    if (window < BDRV_SECTOR_SIZE || window > READAHEAD_MAX_WINDOW_SIZE) {
+        error_setg(errp, "window-size must be between %d and %d",
+                   BDRV_SECTOR_SIZE, READAHEAD_MAX_WINDOW_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    streams = qemu_opt_get_number(opts, READAHEAD_OPT_STREAMS,
+                                  READAHEAD_DEFAULT_STREAMS);
+    if (streams < 1 || streams > READAHEAD_MAX_STREAMS) {
+        error_setg(errp, "streams must be between 1 and %d",
+                   READAHEAD_MAX_STREAMS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    bs->supported_write_flags = bs->file->bs->supported_write_flags;
+    bs->supported_zero_flags = bs->file->bs->supported_zero_flags;
+
+    s->max_window = window;
+    s->nb_streams = streams;
+    s->streams = g_new0(ReadaheadStream, streams);
+    for (i = 0; i < s->nb_streams; i++) {
+        QTAILQ_INIT(&s->streams[i].buffers);
+    }
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    unsigned i;
+
+    /* The node is drained, so no buffer is still being read */
+    for (i = 0; i < s->nb_streams; i++) {
+        readahead_reset_stream(s, &s->streams[i], 0);
+    }
+    g_free(s->streams);
+}
+
+static int readahead_reopen_prepare(BDRVReopenState *reopen_state,
+                                    BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void coroutine_fn readahead_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+
+    /* Nested drained sections only end once */
+    if (!s->drained) {
+        s->drained = true;
+        s->drained_file = bs->file->bs;
+        s->drained_write_gen = atomic_read(&bs->file->bs->write_gen);
+    }
+}
+
+static void coroutine_fn readahead_co_drain_end(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    unsigned i;
+
+    if (!s->drained) {
+        return;
+    }
+    s->drained = false;
+
+    /* Graph changes and block jobs may have replaced or written the image
+     * while it was drained.  Streams stay sequential, but have to read
+     * ahead again. */
+    if (bs->file->bs == s->drained_file &&
+        atomic_read(&bs->file->bs->write_gen) == s->drained_write_gen) {
+        return;
+    }
+    for (i = 0; i < s->nb_streams; i++) {
+        readahead_drop_buffers(&s->streams[i]);
+    }
+}
+
+static bool readahead_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name                        = "readahead",
+    .protocol_name                      = "readahead",
+    .instance_size                      = sizeof(BDRVReadaheadState),
+
+    .bdrv_file_open                     = readahead_open,
+    .bdrv_close                         = readahead_close,
+    .bdrv_reopen_prepare                = readahead_reopen_prepare,
+    .bdrv_child_perm                    = readahead_child_perm,
+
+    .bdrv_getlength                     = readahead_getlength,
+
+    .bdrv_co_preadv                     = readahead_co_preadv,
+    .bdrv_co_pwritev                    = readahead_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = readahead_co_pdiscard,
+    .bdrv_co_get_block_status           = bdrv_co_get_block_status_from_file,
+
+    .bdrv_co_drain_begin                = readahead_co_drain_begin,
+    .bdrv_co_drain_end                  = readahead_co_drain_end,
+    .bdrv_recurse_is_first_non_filter   = readahead_recurse_is_first_non_filter,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
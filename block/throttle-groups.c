@@ -60,6 +60,14 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To keep the lock out of the common path, a ThrottleGroupMember that
+ * goes through it while the group is not throttling takes a batch of
+ * credit from the ThrottleState (see throttle_credit_take()).  Its
+ * following requests spend that credit without taking the lock, until
+ * it runs out, expires or the configuration of the group changes.
+ * Unspent credit that has not expired yet is given back the next time the
+ * lock is taken.
  */
 typedef struct ThrottleGroup {
     Object parent_obj;
@@ -75,6 +83,11 @@ typedef struct ThrottleGroup {
     bool any_timer_armed[2];
     QEMUClockType clock_type;
 
+    /* Incremented whenever ts is reconfigured, which invalidates the credit
+     * of all members.  Written under the lock, read with atomic_read().
+     */
+    unsigned config_generation;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
@@ -281,6 +294,43 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     return must_wait;
 }
 
+/* Give the unspent credit of a ThrottleGroupMember back to the group. Credit
+ * from before the last configuration change is simply dropped, since the
+ * buckets have been emptied since then.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_return_credit(ThrottleGroupMember *tgm,
+                                         bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+
+    if (tgm->credit_generation[is_write] == tg->config_generation) {
+        throttle_credit_return(ts, is_write, qemu_clock_get_ns(tg->clock_type),
+                               &tgm->credit[is_write]);
+    } else {
+        tgm->credit[is_write] = (ThrottleCredit) { 0 };
+        tgm->credit_generation[is_write] = tg->config_generation;
+    }
+}
+
+/* Change the configuration of a group, dropping all credit.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:   the ThrottleGroup
+ * @cfg:  the configuration to set
+ */
+static void throttle_group_do_config(ThrottleGroup *tg, ThrottleConfig *cfg)
+{
+    throttle_config(&tg->ts, tg->clock_type, cfg);
+    atomic_inc(&tg->config_generation);
+}
+
 /* Start the next pending I/O request for a ThrottleGroupMember. Return whether
  * any request was actually pending.
  *
@@ -353,8 +403,22 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    /* Fast path: spend the credit of this member, unless there are earlier
+     * requests in the queue.  pending_reqs is only modified from this
+     * member's AioContext, so it can be read without the lock. */
+    if (!tgm->pending_reqs[is_write] &&
+        tgm->credit_generation[is_write] ==
+            atomic_read(&tg->config_generation) &&
+        throttle_credit_consume(&tgm->credit[is_write], bytes,
+                                qemu_clock_get_ns(tg->clock_type))) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    throttle_group_return_credit(tgm, is_write);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -374,6 +438,14 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
 
+    /* If the group is not throttling, take credit for the next requests */
+    if (!tgm->pending_reqs[is_write] && !tg->any_timer_armed[is_write] &&
+        !atomic_read(&tgm->io_limits_disabled)) {
+        throttle_credit_take(tgm->throttle_state, is_write,
+                             qemu_clock_get_ns(tg->clock_type),
+                             &tgm->credit[is_write]);
+    }
+
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
@@ -439,7 +511,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
-    throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_do_config(tg, cfg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -523,6 +595,11 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
 
+    for (i = 0; i < 2; i++) {
+        tgm->credit[i] = (ThrottleCredit) { 0 };
+        tgm->credit_generation[i] = tg->config_generation;
+    }
+
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
                          tg->clock_type,
@@ -564,6 +641,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
     qemu_mutex_lock(&tg->lock);
     for (i = 0; i < 2; i++) {
+        throttle_group_return_credit(tgm, i);
         if (tg->tokens[i] == tgm) {
             token = throttle_group_next_tgm(tgm);
             /* Take care of the case where this is the last tgm in the group */
@@ -872,7 +950,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_do_config(tg, &cfg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -3,20 +3,86 @@
 #include "profiler.h"
 #include "qemu/error-report.h"
 #include "exec/exec-all.h"
+#ifdef CONFIG_USER_ONLY
+#include "exec/cpu_ldst.h"
+#include "accel/tcg/translate-all.h"
+#endif
+
+#ifdef CONFIG_USER_ONLY
+/*
+ * In user mode the guest address space is mapped directly into the host,
+ * so faults are applied with a plain store through g2h() instead of the
+ * debug access path.  Pages that hold translated code are write protected;
+ * page_unprotect() drops their TBs before we patch them.
+ */
+static void fic_write_guest(target_ulong vaddr, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        target_ulong page = vaddr & TARGET_PAGE_MASK;
+        int l = MIN(len, page + TARGET_PAGE_SIZE - vaddr);
+        int flags = page_get_flags(page);
+
+        if (!(flags & PAGE_VALID) || !(flags & PAGE_WRITE_ORG)) {
+            return;
+        }
+
+        /* Stuck-at values are reapplied on every hook, skip the store
+         * (and the TB invalidation) if memory already holds the value. */
+        if (memcmp(g2h(vaddr), buf, l)) {
+            if (!(flags & PAGE_WRITE)) {
+                page_unprotect(page, 0);
+            }
+            memcpy(g2h(vaddr), buf, l);
+        }
+
+        len -= l;
+        buf += l;
+        vaddr += l;
+    }
+}
+#else
+/*
+ * Stuck-at values are reapplied on every hook.  Rewriting an unchanged
+ * value into instruction memory would still invalidate and retranslate
+ * the TBs covering it, so compare before writing.
+ */
+static bool fic_value_present(CPUState *cpu, StuckAtList *fault)
+{
+    uint8_t buf[64];
+    int off, l;
+
+    for (off = 0; off < fault->numofbytes; off += l) {
+        l = MIN(sizeof(buf), fault->numofbytes - off);
+        if (cpu_memory_rw_debug(cpu, fault->vaddr + off, buf, l, 0) < 0 ||
+            memcmp(buf, fault->membytes + off, l)) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
 
 void fic_inject(CPUArchState *env)
 {
+#ifndef CONFIG_USER_ONLY
     CPUState * cpu = 0;
     if (env == 0) {
         cpu = current_cpu;
     } else {
         cpu = ENV_GET_CPU(env);
     }
+#endif
 
     StuckAtList *curr = stuckAtHead;
     while(curr) {
         profiler_log_generic("fic_inject\n");
-        cpu_memory_rw_debug(cpu, curr->vaddr, curr->membytes, curr->numofbytes, 1);
+#ifdef CONFIG_USER_ONLY
+        fic_write_guest(curr->vaddr, curr->membytes, curr->numofbytes);
+#else
+        if (!fic_value_present(cpu, curr)) {
+            cpu_memory_rw_debug(cpu, curr->vaddr, curr->membytes, curr->numofbytes, 1);
+        }
+#endif
 
         curr = curr->next;
     }
@@ -1,4 +1,5 @@
 #include "fault-injection-library.h"
+#include "qemu-common.h"
 
 StuckAtList *stuckAtHead = 0;
 
@@ -47,6 +48,37 @@ void remove_stuckat_value(hwaddr vaddr)
     }
 }
 
+int parse_fault_value(const char *val, uint8_t **membytes)
+{
+    size_t length = strlen(val);
+    int numOfBytes = (length % 2 ? (length/2 + 1) : (length/2));
+    uint8_t *bytes;
+
+    if (length == 0) {
+        return -1;
+    }
+
+    bytes = (uint8_t *) calloc(numOfBytes, 1);
+
+    for (int i = length-1, j = 0; i >= 0; i--, j++) {
+        if (!qemu_isxdigit(val[i])) {
+            free(bytes);
+            return -1;
+        }
+
+        uint8_t hex = (uint8_t)strtol((char[]){val[i], 0}, NULL, 16);
+
+        if (j%2) { // high nibble
+            bytes[j/2] |= (hex << 4);
+        } else { // low nibble
+            bytes[j/2] |= hex;
+        }
+    }
+
+    *membytes = bytes;
+    return numOfBytes;
+}
+
 void delete_stuckat_list(void)
 {
     StuckAtList *ptr;
@@ -23,4 +23,11 @@ void remove_stuckat_value(hwaddr vaddr);
 
 void delete_stuckat_list(void);
 
+/*
+ * Parse a hex string (without leading 0x) into a newly allocated
+ * little-endian byte array, least significant byte first.
+ * Returns the number of bytes, or -1 if @val is not a hex string.
+ */
+int parse_fault_value(const char *val, uint8_t **membytes);
+
 #endif
@@ -1,10 +1,41 @@
 #include "profiler.h"
 #include "qemu/error-report.h"
 
+//default profiling parameters
+unsigned int profile_log_generic = 0;
+unsigned int profile_tlb = 0;
+
 int open_generic_file = 0;
 
 FILE *outfile_generic;
 
+void profiler_parse_opts(const char *opts)
+{
+    if (!opts || !*opts)
+    {
+        //if no options are given all profiling functions are activated
+        profile_log_generic = 1;
+        profile_tlb = 1;
+        return;
+    }
+
+    for (; *opts; opts++)
+    {
+        switch (*opts) {
+            case 'g':
+                profile_log_generic = 1;
+                error_report("Profile generic");
+                break;
+            case 't':
+                profile_tlb = 1;
+                error_report("Profile softmmu slow path per TB");
+                break;
+            default:
+                break;
+        }
+    }
+}
+
 void profiler_flush_files(void)
 {
     if (open_generic_file)
@@ -6,7 +6,9 @@
 #define OUTPUT_FILE_NAME_GENERIC "profiling-generic.txt"
 
 extern unsigned int profile_log_generic;
+extern unsigned int profile_tlb;
 
+void profiler_parse_opts(const char *opts);
 void profiler_flush_files(void);
 void profiler_close_files(void);
 void profiler_log_generic(const char *fmt, ...);
@@ -0,0 +1,167 @@
+#include "tlb-profiler.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/notify.h"
+#include "qmp-commands.h"
+
+/*
+ * Counters are kept per thread so that vCPUs only ever take their own,
+ * uncontended lock.  query-tlb-profile merges the tables of all threads.
+ * When a thread exits its counters are folded into tlb_profile_retired
+ * and its table is freed.
+ */
+typedef struct TLBProfileEntry {
+    uint64_t pc;
+    uint64_t count[TLB_PROFILE__MAX];
+} TLBProfileEntry;
+
+typedef struct TLBProfile {
+    QemuMutex lock;
+    GHashTable *entries;
+    Notifier exit_notifier;
+    QSLIST_ENTRY(TLBProfile) next;
+} TLBProfile;
+
+/* Protects tlb_profiles and tlb_profile_retired */
+static QemuMutex tlb_profiles_lock;
+static QSLIST_HEAD(, TLBProfile) tlb_profiles =
+    QSLIST_HEAD_INITIALIZER(tlb_profiles);
+static GHashTable *tlb_profile_retired;
+static __thread TLBProfile *tlb_profile_local;
+
+static void __attribute__((__constructor__)) tlb_profile_init(void)
+{
+    qemu_mutex_init(&tlb_profiles_lock);
+}
+
+static GHashTable *tlb_profile_table_new(void)
+{
+    return g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+}
+
+static TLBProfileEntry *tlb_profile_lookup(GHashTable *entries, uint64_t pc)
+{
+    TLBProfileEntry *entry = g_hash_table_lookup(entries, &pc);
+
+    if (!entry) {
+        entry = g_new0(TLBProfileEntry, 1);
+        entry->pc = pc;
+        g_hash_table_insert(entries, &entry->pc, entry);
+    }
+    return entry;
+}
+
+static void tlb_profile_merge(GHashTable *dst, GHashTable *src)
+{
+    GHashTableIter iter;
+    TLBProfileEntry *entry, *sum;
+    int i;
+
+    g_hash_table_iter_init(&iter, src);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        sum = tlb_profile_lookup(dst, entry->pc);
+        for (i = 0; i < TLB_PROFILE__MAX; i++) {
+            sum->count[i] += entry->count[i];
+        }
+    }
+}
+
+static void tlb_profile_thread_exit(Notifier *n, void *unused)
+{
+    TLBProfile *prof = container_of(n, TLBProfile, exit_notifier);
+
+    qemu_mutex_lock(&tlb_profiles_lock);
+    QSLIST_REMOVE(&tlb_profiles, prof, TLBProfile, next);
+    if (!tlb_profile_retired) {
+        tlb_profile_retired = tlb_profile_table_new();
+    }
+    tlb_profile_merge(tlb_profile_retired, prof->entries);
+    qemu_mutex_unlock(&tlb_profiles_lock);
+
+    tlb_profile_local = NULL;
+    g_hash_table_destroy(prof->entries);
+    qemu_mutex_destroy(&prof->lock);
+    g_free(prof);
+}
+
+void tlb_profile_record(uint64_t pc, TLBProfileEvent event)
+{
+    TLBProfile *prof = tlb_profile_local;
+
+    if (!prof) {
+        prof = g_new0(TLBProfile, 1);
+        qemu_mutex_init(&prof->lock);
+        prof->entries = tlb_profile_table_new();
+        prof->exit_notifier.notify = tlb_profile_thread_exit;
+        qemu_thread_atexit_add(&prof->exit_notifier);
+        qemu_mutex_lock(&tlb_profiles_lock);
+        QSLIST_INSERT_HEAD(&tlb_profiles, prof, next);
+        qemu_mutex_unlock(&tlb_profiles_lock);
+        tlb_profile_local = prof;
+    }
+
+    qemu_mutex_lock(&prof->lock);
+    tlb_profile_lookup(prof->entries, pc)->count[event]++;
+    qemu_mutex_unlock(&prof->lock);
+}
+
+static uint64_t tlb_profile_total(const TLBProfileEntry *entry)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < TLB_PROFILE__MAX; i++) {
+        total += entry->count[i];
+    }
+    return total;
+}
+
+static gint tlb_profile_compare(gconstpointer a, gconstpointer b)
+{
+    uint64_t total_a = tlb_profile_total(a);
+    uint64_t total_b = tlb_profile_total(b);
+
+    /* descending */
+    return total_a < total_b ? 1 : total_a > total_b ? -1 : 0;
+}
+
+TlbProfileInfoList *qmp_query_tlb_profile(Error **errp)
+{
+    GHashTable *merged = tlb_profile_table_new();
+    TlbProfileInfoList *head = NULL, **tail = &head;
+    TLBProfileEntry *entry;
+    TLBProfile *prof;
+    GList *sorted, *l;
+
+    qemu_mutex_lock(&tlb_profiles_lock);
+    QSLIST_FOREACH(prof, &tlb_profiles, next) {
+        qemu_mutex_lock(&prof->lock);
+        tlb_profile_merge(merged, prof->entries);
+        qemu_mutex_unlock(&prof->lock);
+    }
+    if (tlb_profile_retired) {
+        tlb_profile_merge(merged, tlb_profile_retired);
+    }
+    qemu_mutex_unlock(&tlb_profiles_lock);
+
+    sorted = g_list_sort(g_hash_table_get_values(merged),
+                         tlb_profile_compare);
+    for (l = sorted; l; l = l->next) {
+        TlbProfileInfoList *elem = g_new0(TlbProfileInfoList, 1);
+        TlbProfileInfo *info = g_new0(TlbProfileInfo, 1);
+
+        entry = l->data;
+        info->pc = entry->pc;
+        info->tlb_misses = entry->count[TLB_PROFILE_MISS];
+        info->victim_hits = entry->count[TLB_PROFILE_VICTIM_HIT];
+        info->io = entry->count[TLB_PROFILE_IO];
+        info->unaligned = entry->count[TLB_PROFILE_UNALIGNED];
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    g_list_free(sorted);
+    g_hash_table_destroy(merged);
+
+    return head;
+}
@@ -0,0 +1,17 @@
+#ifndef TLB_PROFILER_H_
+#define TLB_PROFILER_H_
+
+#include "qemu/osdep.h"
+
+/* softmmu slow path events counted per translation block */
+typedef enum TLBProfileEvent {
+    TLB_PROFILE_MISS,
+    TLB_PROFILE_VICTIM_HIT,
+    TLB_PROFILE_IO,
+    TLB_PROFILE_UNALIGNED,
+    TLB_PROFILE__MAX
+} TLBProfileEvent;
+
+void tlb_profile_record(uint64_t pc, TLBProfileEvent event);
+
+#endif
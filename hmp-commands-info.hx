@@ -363,6 +363,23 @@ STEXI
 @item info profile
 @findex info profile
 Show profiling information.
+ETEXI
+
+    {
+        .name       = "tlbprofile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the translation blocks with most softmmu slow "
+                      "path events (default 20)",
+        .cmd        = hmp_info_tlbprofile,
+    },
+
+STEXI
+@item info tlbprofile [@var{count}]
+@findex info tlbprofile
+Show the @var{count} translation blocks with most TLB misses, victim TLB
+hits, IO accesses and unaligned accesses, as collected with
+@option{-profiling t}.
 ETEXI
 
     {
@@ -396,6 +396,22 @@ STEXI
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
 @var{tag} or the unique snapshot ID @var{id}.
+ETEXI
+
+    {
+        .name       = "replay_seek",
+        .args_type  = "icount:l",
+        .params     = "icount",
+        .help       = "replay execution up to the given instruction count",
+        .cmd        = hmp_replay_seek,
+    },
+
+STEXI
+@item replay_seek @var{icount}
+@findex replay_seek
+In replay mode, restore the replay snapshot closest before instruction
+@var{icount} and replay up to it. The VM is paused when @var{icount} is
+reached.
 ETEXI
 
     {
@@ -43,6 +43,7 @@
 #include "hw/intc/intc.h"
 #include "migration/snapshot.h"
 #include "migration/misc.h"
+#include "sysemu/replay.h"
 
 #ifdef CONFIG_SPICE
 #include <spice/enums.h>
@@ -573,6 +574,28 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
     qapi_free_BlockDeviceInfoList(blockdev_list);
 }
 
+static void print_latency_histogram(Monitor *mon, const char *name,
+                                    BlockLatencyHistogramInfo *hist)
+{
+    uint64List *boundary = hist->boundaries;
+    uint64List *bin;
+    uint64_t start = 0;
+
+    monitor_printf(mon, "    %s_latency_histogram:", name);
+    for (bin = hist->bins; bin; bin = bin->next) {
+        if (boundary) {
+            monitor_printf(mon, " [%" PRIu64 ", %" PRIu64 ")=%" PRIu64,
+                           start, boundary->value, bin->value);
+            start = boundary->value;
+            boundary = boundary->next;
+        } else {
+            monitor_printf(mon, " [%" PRIu64 ", +inf)=%" PRIu64,
+                           start, bin->value);
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
@@ -608,6 +631,19 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->rd_merged,
                        stats->value->stats->wr_merged,
                        stats->value->stats->idle_time_ns);
+
+        if (stats->value->stats->has_rd_latency_histogram) {
+            print_latency_histogram(mon, "rd",
+                                    stats->value->stats->rd_latency_histogram);
+        }
+        if (stats->value->stats->has_wr_latency_histogram) {
+            print_latency_histogram(mon, "wr",
+                                    stats->value->stats->wr_latency_histogram);
+        }
+        if (stats->value->stats->has_flush_latency_histogram) {
+            print_latency_histogram(
+                mon, "flush", stats->value->stats->flush_latency_histogram);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -1335,6 +1371,14 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_replay_seek(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    replay_seek(qdict_get_int(qdict, "icount"), &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_delvm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs;
@@ -2476,6 +2520,26 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_tlbprofile(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 20);
+    TlbProfileInfoList *info_list = qmp_query_tlb_profile(NULL);
+    TlbProfileInfoList *info;
+    TlbProfileInfo *value;
+
+    monitor_printf(mon, "%-18s %12s %12s %12s %12s\n",
+                   "pc", "tlb-misses", "victim-hits", "io", "unaligned");
+    for (info = info_list; info && count > 0; info = info->next, count--) {
+        value = info->value;
+        monitor_printf(mon, "0x%016" PRIx64 " %12" PRId64 " %12" PRId64
+                       " %12" PRId64 " %12" PRId64 "\n",
+                       value->pc, value->tlb_misses, value->victim_hits,
+                       value->io, value->unaligned);
+    }
+
+    qapi_free_TlbProfileInfoList(info_list);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
@@ -42,33 +42,45 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* Virtqueue i is serviced in vq_ctx[i].  By default every entry is ctx,
+     * with iothread-vq-mapping the virtqueues are spread round-robin over
+     * the listed iothreads.  Requests are still submitted and completed in
+     * ctx.
+     */
+    AioContext **vq_ctx;
 };
 
-/* Raise an interrupt to signal guest, if necessary */
+/* Raise an interrupt to signal guest, if necessary
+ *
+ * Requests completed synchronously are completed by the thread that services
+ * the virtqueue, so batch_notify_vqs can be updated concurrently.
+ */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+    unsigned i = virtio_get_queue_index(vq);
+
+    atomic_or(&s->batch_notify_vqs[BIT_WORD(i)], BIT_MASK(i));
     qemu_bh_schedule(s->bh);
 }
 
 static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = atomic_xchg(&s->batch_notify_vqs[BIT_WORD(j)], 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
             VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
+            virtio_blk_vq_lock(vblk, vq);
             virtio_notify_irqfd(s->vdev, vq);
+            virtio_blk_vq_unlock(vblk, vq);
 
             bits &= bits - 1; /* clear right-most bit */
         }
@@ -83,6 +95,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
@@ -105,6 +118,9 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
             return;
         }
+    } else if (conf->num_iothread_vq_mapping) {
+        error_setg(errp, "iothread-vq-mapping requires the iothread property");
+        return;
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
@@ -122,6 +138,22 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     } else {
         s->ctx = qemu_get_aio_context();
     }
+
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        if (conf->num_iothread_vq_mapping) {
+            IOThread *iothread = conf->iothread_vq_mapping[
+                i % conf->num_iothread_vq_mapping];
+
+            s->vq_ctx[i] = iothread_get_aio_context(iothread);
+        } else {
+            s->vq_ctx[i] = s->ctx;
+        }
+        if (s->vq_ctx[i] != s->ctx) {
+            virtio_blk_init_vq_locks(VIRTIO_BLK(vdev));
+        }
+    }
+
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
@@ -141,6 +173,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
+    g_free(s->vq_ctx);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
@@ -151,11 +184,22 @@ static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    AioContext *ctx;
+    bool progress;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
-    return virtio_blk_handle_vq(s, vq);
+    ctx = s->dataplane->vq_ctx[virtio_get_queue_index(vq)];
+    if (ctx == s->dataplane->ctx) {
+        return virtio_blk_handle_vq(s, vq);
+    }
+
+    /* Lets virtio_blk_data_plane_stop() wait for a running handler */
+    aio_context_acquire(ctx);
+    progress = virtio_blk_handle_vq(s, vq);
+    aio_context_release(ctx);
+    return progress;
 }
 
 /* Context: QEMU global mutex held */
@@ -209,14 +253,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -249,15 +293,17 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i], NULL);
+        aio_context_release(s->vq_ctx[i]);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
@@ -13,6 +13,8 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
@@ -45,6 +47,44 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/* Only needed when some virtqueue is serviced outside the BlockBackend's
+ * AioContext; otherwise that context's lock already serializes the ring.
+ */
+void virtio_blk_init_vq_locks(VirtIOBlock *s)
+{
+    unsigned i;
+
+    if (s->vq_locks) {
+        return;
+    }
+    s->vq_locks = g_new(QemuMutex, s->conf.num_queues);
+    for (i = 0; i < s->conf.num_queues; i++) {
+        qemu_mutex_init(&s->vq_locks[i]);
+    }
+}
+
+void virtio_blk_vq_lock(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->vq_locks) {
+        qemu_mutex_lock(&s->vq_locks[virtio_get_queue_index(vq)]);
+    }
+}
+
+void virtio_blk_vq_unlock(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->vq_locks) {
+        qemu_mutex_unlock(&s->vq_locks[virtio_get_queue_index(vq)]);
+    }
+}
+
+static void virtio_blk_detach_request(VirtIOBlockReq *req)
+{
+    virtio_blk_vq_lock(req->dev, req->vq);
+    virtqueue_detach_element(req->vq, &req->elem, 0);
+    virtio_blk_vq_unlock(req->dev, req->vq);
+    virtio_blk_free_request(req);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -53,12 +93,14 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(vdev, req, status);
 
     stb_p(&req->in->status, status);
+    virtio_blk_vq_lock(s, req->vq);
     virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
         virtio_blk_data_plane_notify(s->dataplane, req->vq);
     } else {
         virtio_notify(vdev, req->vq);
     }
+    virtio_blk_vq_unlock(s, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -594,35 +636,63 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+    VirtIOBlockReq *req, *reqs = NULL, **tail = &reqs;
     MultiReqBuffer mrb = {};
-    bool progress = false;
-
-    aio_context_acquire(blk_get_aio_context(s->blk));
-    blk_io_plug(s->blk);
 
+    /* When virtqueues are serviced by different iothreads, walk the ring
+     * with only the virtqueue lock held.  This keeps descriptor parsing out
+     * of the BlockBackend's AioContext lock, which is only taken to submit.
+     */
+    if (s->vq_locks) {
+        virtio_blk_vq_lock(s, vq);
+    } else {
+        aio_context_acquire(ctx);
+    }
     do {
         virtio_queue_set_notification(vq, 0);
 
         while ((req = virtio_blk_get_request(s, vq))) {
-            progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
-                break;
-            }
+            *tail = req;
+            tail = &req->next;
         }
 
         virtio_queue_set_notification(vq, 1);
     } while (!virtio_queue_empty(vq));
 
+    if (s->vq_locks) {
+        virtio_blk_vq_unlock(s, vq);
+        if (!reqs) {
+            return false;
+        }
+        aio_context_acquire(ctx);
+    } else if (!reqs) {
+        aio_context_release(ctx);
+        return false;
+    }
+
+    blk_io_plug(s->blk);
+
+    while ((req = reqs)) {
+        reqs = req->next;
+        req->next = NULL;
+        if (virtio_blk_handle_request(req, &mrb)) {
+            /* The device is broken now, drop the rest of the batch too */
+            virtio_blk_detach_request(req);
+            while ((req = reqs)) {
+                reqs = req->next;
+                virtio_blk_detach_request(req);
+            }
+        }
+    }
+
     if (mrb.num_reqs) {
         virtio_blk_submit_multireq(s->blk, &mrb);
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
-    return progress;
+    aio_context_release(ctx);
+    return true;
 }
 
 static void virtio_blk_handle_output_do(VirtIOBlock *s, VirtQueue *vq)
@@ -666,8 +736,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
              */
             while (req) {
                 next = req->next;
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+                virtio_blk_detach_request(req);
                 req = next;
             }
             break;
@@ -712,8 +781,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
     while (s->rq) {
         req = s->rq;
         s->rq = req->next;
-        virtqueue_detach_element(req->vq, &req->elem, 0);
-        virtio_blk_free_request(req);
+        virtio_blk_detach_request(req);
     }
 
     aio_context_release(ctx);
@@ -908,6 +976,20 @@ static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
 };
 
+static void virtio_blk_destroy_vq_locks(VirtIOBlock *s)
+{
+    unsigned i;
+
+    if (!s->vq_locks) {
+        return;
+    }
+    for (i = 0; i < s->conf.num_queues; i++) {
+        qemu_mutex_destroy(&s->vq_locks[i]);
+    }
+    g_free(s->vq_locks);
+    s->vq_locks = NULL;
+}
+
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -958,6 +1040,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        virtio_blk_destroy_vq_locks(s);
         virtio_cleanup(vdev);
         return;
     }
@@ -978,6 +1061,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
+    virtio_blk_destroy_vq_locks(s);
     virtio_cleanup(vdev);
 }
 
@@ -1000,6 +1084,89 @@ static const VMStateDescription vmstate_virtio_blk = {
     },
 };
 
+/* iothread-vq-mapping: a list of iothread links.  Every occurrence of the
+ * property appends one iothread, e.g.
+ * -device virtio-blk-pci,iothread=io0,iothread-vq-mapping=io0,\
+ *         iothread-vq-mapping=io1
+ */
+static void get_iothread_vq_mapping(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    VirtIOBlkConf *conf = &VIRTIO_BLK(obj)->conf;
+    strList *list = NULL, **tail = &list;
+    unsigned i;
+
+    for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+        strList *entry = g_new0(strList, 1);
+
+        entry->value = object_get_canonical_path_component(
+                           OBJECT(conf->iothread_vq_mapping[i]));
+        *tail = entry;
+        tail = &entry->next;
+    }
+    visit_type_strList(v, name, &list, errp);
+    qapi_free_strList(list);
+}
+
+static void set_iothread_vq_mapping(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    DeviceState *dev = DEVICE(obj);
+    VirtIOBlkConf *conf = &VIRTIO_BLK(obj)->conf;
+    Error *local_err = NULL;
+    Object *iothread;
+    char *str;
+
+    if (dev->realized) {
+        qdev_prop_set_after_realize(dev, name, errp);
+        return;
+    }
+
+    visit_type_str(v, name, &str, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    iothread = object_resolve_path_type(str, TYPE_IOTHREAD, NULL);
+    if (!iothread) {
+        error_setg(errp, "Property '%s.%s' can't find iothread '%s'",
+                   object_get_typename(obj), name, str);
+        g_free(str);
+        return;
+    }
+    g_free(str);
+
+    object_ref(iothread);
+    conf->iothread_vq_mapping = g_renew(IOThread *, conf->iothread_vq_mapping,
+                                        conf->num_iothread_vq_mapping + 1);
+    conf->iothread_vq_mapping[conf->num_iothread_vq_mapping++] =
+        IOTHREAD(iothread);
+}
+
+static void release_iothread_vq_mapping(Object *obj, const char *name,
+                                        void *opaque)
+{
+    VirtIOBlkConf *conf = &VIRTIO_BLK(obj)->conf;
+    unsigned i;
+
+    for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+        object_unref(OBJECT(conf->iothread_vq_mapping[i]));
+    }
+    g_free(conf->iothread_vq_mapping);
+    conf->iothread_vq_mapping = NULL;
+    conf->num_iothread_vq_mapping = 0;
+}
+
+static const PropertyInfo virtio_blk_prop_iothread_vq_mapping = {
+    .name = "IOThreadList",
+    .description = "IOThreads servicing the virtqueues, round-robin; "
+                   "repeat the property to add an IOThread",
+    .get = get_iothread_vq_mapping,
+    .set = set_iothread_vq_mapping,
+    .release = release_iothread_vq_mapping,
+};
+
 static Property virtio_blk_properties[] = {
     DEFINE_BLOCK_PROPERTIES(VirtIOBlock, conf.conf),
     DEFINE_BLOCK_ERROR_PROPERTIES(VirtIOBlock, conf.conf),
@@ -1014,6 +1181,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP("iothread-vq-mapping", VirtIOBlock, conf.iothread_vq_mapping,
+                virtio_blk_prop_iothread_vq_mapping, IOThread **),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 typedef struct BlockAcctStats BlockAcctStats;
@@ -45,6 +46,19 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+typedef struct BlockLatencyHistogram {
+    /* The histogram has @nbins bins.  Bin i counts the requests with a
+     * latency in [boundaries[i - 1], boundaries[i]) nanoseconds, where the
+     * first bin starts at 0 and the last one is open-ended.  For example,
+     * boundaries {10, 50, 100} give the bins [0, 10), [10, 50), [50, 100)
+     * and [100, +inf).
+     *
+     * @bins is NULL while the histogram is disabled. */
+    int nbins;
+    uint64_t *boundaries; /* @nbins - 1 ascending values */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -55,6 +69,7 @@ struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 };
@@ -82,5 +97,10 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
+BlockLatencyHistogramInfo *
+block_latency_histogram_info(BlockAcctStats *stats, enum BlockAcctType type);
 
 #endif
@@ -38,6 +38,7 @@
 #include "qemu/throttle.h"
 
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTENDED_L2      16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -57,6 +58,8 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -201,6 +204,27 @@ struct BlockDriver {
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int bytes);
 
+    /*
+     * Map [src_offset, src_offset + bytes) onto a child of @bs and continue
+     * with bdrv_co_copy_range_from() on that child, or call
+     * bdrv_co_copy_range_to() if @bs itself holds the data.  May return
+     * -ENOTSUP, in which case the caller copies the data through a buffer.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset, BdrvChild *dst,
+        int64_t dst_offset, unsigned int bytes,
+        BdrvRequestFlags read_flags, BdrvRequestFlags write_flags);
+
+    /*
+     * Map [dst_offset, dst_offset + bytes) onto a child of @bs and continue
+     * with bdrv_co_copy_range_to() on that child, or perform the copy if @bs
+     * itself stores the data.  @src is the leaf node to copy from.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, int64_t src_offset, BdrvChild *dst,
+        int64_t dst_offset, unsigned int bytes,
+        BdrvRequestFlags read_flags, BdrvRequestFlags write_flags);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -270,6 +294,15 @@ struct BlockDriver {
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
 
+    /*
+     * Returns a host file descriptor from which @bytes of guest data at
+     * @offset can be read directly (e.g. with sendfile()), starting at
+     * *@host_offset in that file.  Drivers that cannot guarantee this return
+     * -ENOTSUP.  The descriptor is only valid until the next yield.
+     */
+    int (*bdrv_get_read_fd)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int64_t *host_offset);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -768,6 +801,32 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
 
+static inline int coroutine_fn bdrv_co_pread(BdrvChild *child,
+    int64_t offset, unsigned int bytes, void *buf, BdrvRequestFlags flags)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = bytes,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_co_preadv(child, offset, bytes, &qiov, flags);
+}
+
+static inline int coroutine_fn bdrv_co_pwrite(BdrvChild *child,
+    int64_t offset, unsigned int bytes, void *buf, BdrvRequestFlags flags)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = bytes,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return bdrv_co_pwritev(child, offset, bytes, &qiov, flags);
+}
+
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
@@ -43,6 +43,14 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int io_limits_disabled;
 
+    /* Credit taken from the group so that requests can be accounted
+     * without the ThrottleGroup lock, and the group's config_generation
+     * at the time it was taken.  Only used in aio_context, or under the
+     * ThrottleGroup lock when the member is drained.
+     */
+    ThrottleCredit credit[2];
+    unsigned       credit_generation[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -58,6 +58,17 @@ void cpu_gen_init(void);
  */
 bool cpu_restore_state(CPUState *cpu, uintptr_t searched_pc);
 
+/**
+ * tb_host_pc_to_guest_pc:
+ * @host_pc: host pc inside translated code, e.g. a helper's GETPC()
+ * @pc: set to the guest pc of the TB containing @host_pc
+ *
+ * @return: true if @host_pc is inside a TB, false otherwise
+ *
+ * Must not be called with tb_lock held.
+ */
+bool tb_host_pc_to_guest_pc(uintptr_t host_pc, target_ulong *pc);
+
 void QEMU_NORETURN cpu_loop_exit_noexc(CPUState *cpu);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
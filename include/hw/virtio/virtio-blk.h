@@ -34,6 +34,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    IOThread **iothread_vq_mapping;
+    uint32_t num_iothread_vq_mapping;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -56,6 +58,12 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    /* Serializes virtqueue_pop() in the thread that services a virtqueue
+     * against virtqueue_push() in the thread that completes requests.
+     * One lock per virtqueue.  Lock order: AioContext lock, then vq lock.
+     * NULL if every virtqueue is serviced in the BlockBackend's AioContext.
+     */
+    QemuMutex *vq_locks;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -81,5 +89,8 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_init_vq_locks(VirtIOBlock *s);
+void virtio_blk_vq_lock(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_vq_unlock(VirtIOBlock *s, VirtQueue *vq);
 
 #endif
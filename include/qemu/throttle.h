@@ -99,6 +99,18 @@ typedef struct ThrottleState {
     int64_t previous_leak;    /* timestamp of the last leak done */
 } ThrottleState;
 
+/* Credit handed out by throttle_credit_take(): the bytes and operations
+ * (in the units of throttle_account()) that can be done without being
+ * throttled.  INFINITY means that there is no limit.
+ */
+typedef struct ThrottleCredit {
+    double   bytes;           /* bytes left */
+    double   units;           /* operations left */
+    uint64_t op_size;         /* the op_size in effect when it was taken */
+    int64_t  taken;           /* timestamp of throttle_credit_take() */
+    int64_t  expires;         /* timestamp at which it has leaked entirely */
+} ThrottleCredit;
+
 typedef struct ThrottleTimers {
     QEMUTimer *timers[2];     /* timers used to do the throttling */
     QEMUClockType clock_type; /* the clock used */
@@ -152,6 +164,14 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              bool is_write);
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+void throttle_credit_take(ThrottleState *ts, bool is_write, int64_t now,
+                          ThrottleCredit *credit);
+bool throttle_credit_consume(ThrottleCredit *credit, uint64_t size,
+                             int64_t now);
+void throttle_credit_return(ThrottleState *ts, bool is_write, int64_t now,
+                            ThrottleCredit *credit);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
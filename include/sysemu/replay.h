@@ -57,6 +57,9 @@ void replay_start(void);
 void replay_finish(void);
 /*! Adds replay blocker with the specified error description */
 void replay_add_blocker(Error *reason);
+/*! Restores the snapshot closest before the given instruction count and
+    replays up to it. The VM is paused when that point is reached. */
+void replay_seek(int64_t icount, Error **errp);
 
 /* Processing the instructions */
 
@@ -36,6 +36,8 @@
 #include "exec/log.h"
 #include "trace/control.h"
 #include "glib-compat.h"
+#include "fies/fault-injection-library.h"
+#include "fies/profiler.h"
 
 char *exec_path;
 
@@ -4038,6 +4040,42 @@ static void handle_arg_trace(const char *arg)
     trace_file = trace_opt_parse(arg);
 }
 
+static void handle_arg_stuckat(const char *arg)
+{
+    gchar **faults = g_strsplit(arg, ",", 0);
+    int i;
+
+    for (i = 0; faults[i]; i++) {
+        char *val = strchr(faults[i], '=');
+        uint64_t vaddr;
+        uint8_t *membytes;
+        int numofbytes;
+
+        if (!val) {
+            fprintf(stderr, "Stuck-at fault '%s' is not addr=value\n",
+                    faults[i]);
+            exit(EXIT_FAILURE);
+        }
+        *val++ = '\0';
+        if (qemu_strtou64(faults[i], NULL, 0, &vaddr) < 0) {
+            fprintf(stderr, "Invalid stuck-at address '%s'\n", faults[i]);
+            exit(EXIT_FAILURE);
+        }
+        numofbytes = parse_fault_value(val, &membytes);
+        if (numofbytes < 0) {
+            fprintf(stderr, "Invalid stuck-at value '%s'\n", val);
+            exit(EXIT_FAILURE);
+        }
+        insert_stuckat_value(vaddr, membytes, numofbytes);
+    }
+    g_strfreev(faults);
+}
+
+static void handle_arg_profiling(const char *arg)
+{
+    profiler_parse_opts(arg);
+}
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -4089,6 +4127,10 @@ static const struct qemu_argument arg_table[] = {
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
      "",           "[[enable=]<pattern>][,events=<file>][,file=<file>]"},
+    {"stuckat",    "QEMU_STUCKAT",     true,  handle_arg_stuckat,
+     "addr=val[,...]", "keep guest memory at 'addr' stuck at hex value 'val'"},
+    {"profiling",  "QEMU_PROFILING",   true,  handle_arg_profiling,
+     "g",          "activate generic profiling"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -116,6 +116,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "uname.h"
 
 #include "qemu.h"
+#include "fies/profiler.h"
 
 #ifndef CLONE_IO
 #define CLONE_IO                0x80000000      /* Clone io context */
@@ -7792,6 +7793,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        profiler_close_files();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -9867,6 +9869,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        profiler_close_files();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -1417,18 +1417,12 @@ static void hmp_inject_value(Monitor *mon, const QDict *qdict)
     hwaddr addressValue = strtoul(address, NULL ,0);
 
     const char *val = qdict_get_str(qdict, "val");
-    size_t length = strlen(val);
-    int numOfBytes = (length % 2 ? (length/2 + 1) : (length/2));
-    uint8_t *membytes = (uint8_t *) calloc(numOfBytes,1);
+    uint8_t *membytes;
+    int numOfBytes = parse_fault_value(val, &membytes);
 
-    for(int i = length-1, j = 0; i >= 0; i--, j++) {
-        uint8_t hex = (uint8_t)strtol((char[]){val[i], 0}, NULL, 16);
-
-        if (i%2) { // odd
-            membytes[j/2] |= hex;
-        } else { // even
-            membytes[j/2] |= (hex << 4);
-        }
+    if (numOfBytes < 0) {
+        monitor_printf(mon, "Invalid hex value '%s'\n", val);
+        return;
     }
 
     if (cpu_memory_rw_debug(mon_get_cpu(), addressValue, membytes, numOfBytes , 1) < 0) {
@@ -1448,19 +1442,12 @@ static void hmp_inject_stuckat_value(Monitor *mon, const QDict *qdict)
     hwaddr addressValue = strtoul(address, NULL ,0);
 
     const char *val = qdict_get_str(qdict, "val");
-    size_t length = strlen(val);
-
-    int numOfBytes = (length % 2 ? (length/2 + 1) : (length/2));
-    uint8_t *membytes = (uint8_t *) calloc(numOfBytes,1);
+    uint8_t *membytes;
+    int numOfBytes = parse_fault_value(val, &membytes);
 
-    for(int i = length-1, j = 0; i >= 0; i--, j++) {
-        uint8_t hex = (uint8_t)strtol((char[]){val[i], 0}, NULL, 16);
-
-        if (i%2) { // odd
-            membytes[j/2] |= hex;
-        } else { // even
-            membytes[j/2] |= (hex << 4);
-        }
+    if (numOfBytes < 0) {
+        monitor_printf(mon, "Invalid hex value '%s'\n", val);
+        return;
     }
 
     insert_stuckat_value(addressValue, membytes, numOfBytes);
@@ -22,6 +22,10 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -59,6 +63,13 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+
+    /* For NBD_CMD_READ: the export offset of the request and, if the data
+     * can be sent directly from a host file, a descriptor for that file and
+     * the host offset corresponding to @from; -1 otherwise */
+    uint64_t from;
+    int fd;
+    int64_t fd_offset;
 };
 
 struct NBDExport {
@@ -1001,6 +1012,7 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     req = g_new0(NBDRequestData, 1);
     nbd_client_get(client);
     req->client = client;
+    req->fd = -1;
     return req;
 }
 
@@ -1011,6 +1023,9 @@ static void nbd_request_put(NBDRequestData *req)
     if (req->data) {
         qemu_vfree(req->data);
     }
+    if (req->fd >= 0) {
+        close(req->fd);
+    }
     g_free(req);
 
     client->nb_requests--;
@@ -1227,8 +1242,68 @@ void nbd_export_close_all(void)
     }
 }
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+#ifdef CONFIG_SENDFILE
+/*
+ * Copies @size bytes at @offset of the host file @fd to the client socket
+ * with sendfile(), so that the data does not pass through a userspace buffer.
+ * Any part past the end of the file is sent as zeros, just like file-posix
+ * reads it.  The caller must hold client->send_lock.
+ *
+ * sendfile() reads the file synchronously; blk_get_read_fd() only returns a
+ * descriptor for data in the page cache, so this does not normally wait for
+ * the disk.  The export is read behind the back of the block layer, so each
+ * call is accounted as in flight.  Waiting for the client is not, otherwise
+ * a stalled client would block draining the export.
+ */
+static int coroutine_fn nbd_co_sendfile(NBDClient *client, int fd,
+                                        off_t offset, size_t size,
+                                        Error **errp)
+{
+    trace_nbd_co_sendfile(fd, offset, size);
+
+    while (size > 0) {
+        ssize_t len;
+        int err;
+
+        blk_inc_in_flight(client->exp->blk);
+        len = sendfile(client->sioc->fd, fd, &offset, size);
+        err = errno;
+        blk_dec_in_flight(client->exp->blk);
+
+        if (len < 0) {
+            if (err == EAGAIN) {
+                qio_channel_yield(client->ioc, G_IO_OUT);
+                continue;
+            } else if (err == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, err, "sendfile failed");
+            return -EIO;
+        } else if (len == 0) {
+            break;
+        }
+        size -= len;
+    }
+
+    if (size > 0) {
+        void *zeroes = g_malloc0(size);
+        int ret = qio_channel_write_all(client->ioc, zeroes, size, errp);
+
+        g_free(zeroes);
+        return ret < 0 ? -EIO : 0;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Sends @iov to the client.  If @fd is not -1, @size bytes at @offset of that
+ * host file are sent right after it, see nbd_co_sendfile().
+ */
+static int coroutine_fn nbd_co_send_iov_fd(NBDClient *client,
+                                           struct iovec *iov, unsigned niov,
+                                           int fd, off_t offset, size_t size,
+                                           Error **errp)
 {
     int ret;
 
@@ -1236,14 +1311,118 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
+    if (fd >= 0) {
+        /* Send header and payload in as few packets as possible */
+        qio_channel_set_cork(client->ioc, true);
+    }
+
     ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
 
+#ifdef CONFIG_SENDFILE
+    if (ret == 0 && fd >= 0) {
+        ret = nbd_co_sendfile(client, fd, offset, size, errp);
+    }
+#else
+    assert(fd < 0);
+#endif
+    if (ret < 0) {
+        /* A reply may have been sent in part; the stream cannot be
+         * resynchronized, so make sure nothing else is sent */
+        qio_channel_shutdown(client->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+
+    if (fd >= 0) {
+        qio_channel_set_cork(client->ioc, false);
+    }
+
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
 
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_fd(client, iov, niov, -1, 0, 0, errp);
+}
+
+/*
+ * Prepares sending the data of the NBD_CMD_READ request @req for @len bytes
+ * at @from: if the export is a raw image on a host file and the connection is
+ * not encrypted, the data is later sent directly from that file, see
+ * nbd_co_sendfile().  Otherwise a bounce buffer is allocated in req->data.
+ */
+static int nbd_prepare_read(NBDRequestData *req, uint64_t from, uint32_t len,
+                            Error **errp)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+
+    req->from = from;
+
+#ifdef CONFIG_SENDFILE
+    if (client->ioc == QIO_CHANNEL(client->sioc) && len) {
+        int fd = blk_get_read_fd(exp->blk, from + exp->dev_offset, len,
+                                 &req->fd_offset);
+
+        /* The driver may close its descriptor (e.g. on reopen) while we
+         * wait for the socket, so use our own */
+        if (fd >= 0) {
+            req->fd = qemu_dup(fd);
+        }
+        if (req->fd >= 0) {
+            return 0;
+        }
+    }
+#endif
+
+    req->data = blk_try_blockalign(exp->blk, len);
+    if (req->data == NULL) {
+        error_setg(errp, "No memory");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Sends the reply header @hdr followed by @size bytes of data at @offset,
+ * which must be part of the read request @req.
+ *
+ * If the data cannot be read, nothing is sent and -errno is returned, so the
+ * caller can still send an error reply.
+ */
+static int coroutine_fn nbd_co_send_read_data(NBDRequestData *req,
+                                              uint64_t offset, size_t size,
+                                              void *hdr, size_t hdr_len,
+                                              Error **errp)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint64_t skip = offset - req->from;
+    struct iovec iov[] = {
+        {.iov_base = hdr, .iov_len = hdr_len},
+        {.iov_base = NULL, .iov_len = size},
+    };
+    int ret;
+
+    if (req->fd >= 0) {
+        return nbd_co_send_iov_fd(client, iov, 1, req->fd,
+                                  req->fd_offset + skip, size, errp);
+    }
+
+    iov[1].iov_base = req->data + skip;
+
+    ret = blk_pread(exp->blk, offset + exp->dev_offset, iov[1].iov_base,
+                    size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "reading from file failed");
+        return ret;
+    }
+
+    return nbd_co_send_iov(client, iov, 2, errp);
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1255,22 +1434,33 @@ static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
 static int nbd_co_send_simple_reply(NBDClient *client,
                                     uint64_t handle,
                                     uint32_t error,
-                                    void *data,
-                                    size_t len,
                                     Error **errp)
 {
     NBDSimpleReply reply;
     int nbd_err = system_errno_to_nbd_errno(error);
     struct iovec iov[] = {
         {.iov_base = &reply, .iov_len = sizeof(reply)},
-        {.iov_base = data, .iov_len = len}
     };
 
     trace_nbd_co_send_simple_reply(handle, nbd_err, nbd_err_lookup(nbd_err),
-                                   len);
+                                   0);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+static int coroutine_fn nbd_co_send_simple_read(NBDRequestData *req,
+                                                uint64_t handle,
+                                                size_t len,
+                                                Error **errp)
+{
+    NBDSimpleReply reply;
+
+    trace_nbd_co_send_simple_reply(handle, 0, nbd_err_lookup(0), len);
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_read_data(req, req->from, len, &reply, sizeof(reply),
+                                 errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1298,26 +1488,94 @@ static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
-static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
+static int coroutine_fn nbd_co_send_structured_read(NBDRequestData *req,
                                                     uint64_t handle,
                                                     uint64_t offset,
-                                                    void *data,
                                                     size_t size,
+                                                    bool final,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
+
+    assert(size);
+    trace_nbd_co_send_structured_read(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_read_data(req, offset, size, &chunk, sizeof(chunk),
+                                 errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_hole(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    uint32_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadHole chunk;
     struct iovec iov[] = {
         {.iov_base = &chunk, .iov_len = sizeof(chunk)},
-        {.iov_base = data, .iov_len = size}
     };
 
-    assert(size);
-    trace_nbd_co_send_structured_read(handle, offset, data, size);
-    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA,
-                 handle, sizeof(chunk) - sizeof(chunk.h) + size);
+    trace_nbd_co_send_structured_read_hole(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE, handle,
+                 sizeof(chunk) - sizeof(chunk.h));
     stq_be_p(&chunk.offset, offset);
+    stl_be_p(&chunk.length, size);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+/*
+ * Sends the data of the read request @req as structured reply chunks, with
+ * areas that read as zeros described by hole chunks instead of being sent.
+ */
+static int coroutine_fn nbd_co_send_sparse_read(NBDRequestData *req,
+                                                uint64_t handle,
+                                                uint32_t size,
+                                                Error **errp)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint64_t offset = req->from;
+    uint32_t progress = 0;
+    int ret;
+
+    while (progress < size) {
+        int64_t pnum;
+        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                             offset + progress +
+                                             exp->dev_offset,
+                                             size - progress, &pnum, NULL,
+                                             NULL);
+        bool final;
+
+        if (status < 0) {
+            error_setg_errno(errp, -status, "unable to check for holes");
+            return status;
+        }
+        assert(pnum && pnum <= size - progress);
+        final = progress + pnum == size;
+
+        if (status & BDRV_BLOCK_ZERO) {
+            ret = nbd_co_send_structured_hole(client, handle,
+                                              offset + progress, pnum, final,
+                                              errp);
+        } else {
+            ret = nbd_co_send_structured_read(req, handle, offset + progress,
+                                              pnum, final, errp);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        progress += pnum;
+    }
+
+    return 0;
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -1382,14 +1640,15 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                        request->len, NBD_MAX_BUFFER_SIZE);
             return -EINVAL;
         }
-
+    }
+    if (request->type == NBD_CMD_WRITE) {
+        /* Read buffers are set up by nbd_prepare_read() */
         req->data = blk_try_blockalign(client->exp->blk, request->len);
         if (req->data == NULL) {
             error_setg(errp, "No memory");
             return -ENOMEM;
         }
-    }
-    if (request->type == NBD_CMD_WRITE) {
+
         if (nbd_read(client->ioc, req->data, request->len, errp) < 0) {
             error_prepend(errp, "reading from socket failed: ");
             return -EIO;
@@ -1440,7 +1699,6 @@ static coroutine_fn void nbd_trip(void *opaque)
     NBDRequest request = { 0 };    /* GCC thinks it can be used uninitialized */
     int ret;
     int flags;
-    int reply_data_len = 0;
     Error *local_err = NULL;
     char *msg = NULL;
 
@@ -1481,16 +1739,31 @@ static coroutine_fn void nbd_trip(void *opaque)
             }
         }
 
-        ret = blk_pread(exp->blk, request.from + exp->dev_offset,
-                        req->data, request.len);
+        ret = nbd_prepare_read(req, request.from, request.len, &local_err);
         if (ret < 0) {
-            error_setg_errno(&local_err, -ret, "reading from file failed");
             break;
         }
 
-        reply_data_len = request.len;
-
-        break;
+        /* Send the data right away; if that fails before anything was sent,
+         * an error reply follows */
+        if (client->structured_reply && !request.len) {
+            break;
+        } else if (client->structured_reply &&
+                   !(request.flags & NBD_CMD_FLAG_DF)) {
+            ret = nbd_co_send_sparse_read(req, request.handle, request.len,
+                                          &local_err);
+        } else if (client->structured_reply) {
+            ret = nbd_co_send_structured_read(req, request.handle,
+                                              request.from, request.len,
+                                              true, &local_err);
+        } else {
+            ret = nbd_co_send_simple_read(req, request.handle, request.len,
+                                          &local_err);
+        }
+        if (ret < 0) {
+            break;
+        }
+        goto done;
     case NBD_CMD_WRITE:
         flags = 0;
         if (request.flags & NBD_CMD_FLAG_FUA) {
@@ -1558,18 +1831,13 @@ reply:
         if (ret < 0) {
             ret = nbd_co_send_structured_error(req->client, request.handle,
                                                -ret, msg, &local_err);
-        } else if (reply_data_len) {
-            ret = nbd_co_send_structured_read(req->client, request.handle,
-                                              request.from, req->data,
-                                              reply_data_len, &local_err);
         } else {
             ret = nbd_co_send_structured_done(req->client, request.handle,
                                               &local_err);
         }
     } else {
         ret = nbd_co_send_simple_reply(req->client, request.handle,
-                                       ret < 0 ? -ret : 0,
-                                       req->data, reply_data_len, &local_err);
+                                       ret < 0 ? -ret : 0, &local_err);
     }
     g_free(msg);
     if (ret < 0) {
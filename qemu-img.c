@@ -178,6 +178,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '-C' copy allocated data with copy_file_range() or reflinks where the\n"
+           "       source and target support it, without checking it for zeroes\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -190,6 +192,8 @@ static void QEMU_NORETURN help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' specifies how many coroutines compare data in parallel (defaults\n"
+           "       to 8)\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -1075,6 +1079,10 @@ static int64_t find_nonzero(const uint8_t *buf, int64_t n)
     int64_t i;
     int64_t end = QEMU_ALIGN_DOWN(n, BDRV_SECTOR_SIZE);
 
+    if (buffer_is_zero(buf, n)) {
+        return -1;
+    }
+
     for (i = 0; i < end; i += BDRV_SECTOR_SIZE) {
         if (!buffer_is_zero(buf + i, BDRV_SECTOR_SIZE)) {
             return i;
@@ -1170,6 +1178,13 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
     assert(bytes > 0);
 
+    /* Let memcmp() run over the whole buffer first, which is much faster
+     * than going sector by sector; the common case is that nothing differs */
+    if (!memcmp(buf1, buf2, bytes)) {
+        *pnum = bytes;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, i);
     while (i < bytes) {
         int64_t len = MIN(bytes - i, BDRV_SECTOR_SIZE);
@@ -1186,42 +1201,256 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+enum ImgCompareAction {
+    COMPARE_SKIP,
+    COMPARE_DATA,
+    COMPARE_EMPTY1,     /* only the first image must read as zeroes */
+    COMPARE_EMPTY2,     /* only the second image must read as zeroes */
+};
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size1, total_size2;
+    int64_t total_size;
+    int64_t progress_base;
+    bool strict;
+    bool quiet;
+    int running_coroutines;
+    CoMutex lock;
+    /* Next offset to be handed out to a coroutine */
+    int64_t offset;
+
+    /* The difference or error at the lowest offset found so far.  Requests
+     * that are already in flight below it are completed, since they may
+     * still find an earlier one. */
+    int64_t fail_offset;
+    int fail_ret;
+    bool fail_is_error;
+    char *fail_msg;
+} ImgCompareState;
+
+static void GCC_FMT_ATTR(5, 6) compare_fail(ImgCompareState *s, int64_t offset,
+                                            int ret, bool is_error,
+                                            const char *fmt, ...)
+{
+    va_list ap;
+
+    if (offset >= s->fail_offset) {
+        return;
+    }
+
+    g_free(s->fail_msg);
+    va_start(ap, fmt);
+    s->fail_msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    s->fail_offset = offset;
+    s->fail_ret = ret;
+    s->fail_is_error = is_error;
+}
+
 /*
- * Check if passed sectors are empty (not allocated or contain only 0 bytes)
- *
- * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
- * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
- *
- * @param blk:  BlockBackend for the image
- * @param offset: Starting offset to check
- * @param bytes: Number of bytes to check
- * @param filename: Name of disk file we are checking (logging purpose)
- * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * Decides how the area starting at @offset must be compared and stores its
+ * length in *@bytes.  Returns an ImgCompareAction, or -1 after a failure was
+ * recorded with compare_fail().
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int coroutine_fn compare_iteration(ImgCompareState *s, int64_t offset,
+                                          int64_t *bytes)
 {
-    int ret = 0;
-    int64_t idx;
+    BlockBackend *blk_over;
+    const char *filename_over;
+    int64_t pnum1, pnum2;
+    int status1, status2;
+    bool allocated1, allocated2;
+
+    if (offset >= s->total_size) {
+        /* Only the larger image is left, it must read as zeroes */
+        if (s->total_size1 > s->total_size2) {
+            blk_over = s->blk1;
+            filename_over = s->filename1;
+        } else {
+            blk_over = s->blk2;
+            filename_over = s->filename2;
+        }
+
+        status1 = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
+                                          s->progress_base - offset, bytes,
+                                          NULL, NULL);
+        if (status1 < 0) {
+            compare_fail(s, offset, 3, true,
+                         "Sector allocation test failed for %s",
+                         filename_over);
+            return -1;
+        }
+        if (status1 & BDRV_BLOCK_ALLOCATED && !(status1 & BDRV_BLOCK_ZERO)) {
+            *bytes = MIN(*bytes, IO_BUF_SIZE);
+            return blk_over == s->blk1 ? COMPARE_EMPTY1 : COMPARE_EMPTY2;
+        }
+        return COMPARE_SKIP;
+    }
+
+    status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, offset,
+                                      s->total_size1 - offset, &pnum1, NULL,
+                                      NULL);
+    if (status1 < 0) {
+        compare_fail(s, offset, 3, true,
+                     "Sector allocation test failed for %s", s->filename1);
+        return -1;
+    }
+    allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+
+    status2 = bdrv_block_status_above(blk_bs(s->blk2), NULL, offset,
+                                      s->total_size2 - offset, &pnum2, NULL,
+                                      NULL);
+    if (status2 < 0) {
+        compare_fail(s, offset, 3, true,
+                     "Sector allocation test failed for %s", s->filename2);
+        return -1;
+    }
+    allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+    assert(pnum1 && pnum2);
+    *bytes = MIN(pnum1, pnum2);
+
+    if (s->strict && status1 != status2) {
+        compare_fail(s, offset, 1, false, "Strict mode: Offset %" PRId64
+                     " block status mismatch!\n", offset);
+        return -1;
+    }
+
+    if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        return COMPARE_SKIP;
+    } else if (allocated1 == allocated2) {
+        if (!allocated1) {
+            return COMPARE_SKIP;
+        }
+        *bytes = MIN(*bytes, IO_BUF_SIZE);
+        return COMPARE_DATA;
+    } else {
+        *bytes = MIN(*bytes, IO_BUF_SIZE);
+        return allocated1 ? COMPARE_EMPTY1 : COMPARE_EMPTY2;
+    }
+}
+
+static int coroutine_fn compare_co_read(ImgCompareState *s, BlockBackend *blk,
+                                        const char *filename, int64_t offset,
+                                        int64_t bytes, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = bytes,
+    };
+    int ret;
 
-    ret = blk_pread(blk, offset, buffer, bytes);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = blk_co_preadv(blk, offset, bytes, &qiov, 0);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
+        compare_fail(s, offset, 4, true,
+                     "Error while reading offset %" PRId64 " of %s: %s",
                      offset, filename, strerror(-ret));
-        return 4;
     }
-    idx = find_nonzero(buffer, bytes);
+    return ret;
+}
+
+/*
+ * Check if passed bytes are empty (not allocated or contain only 0 bytes),
+ * recording a content mismatch if they are not
+ */
+static void coroutine_fn compare_co_check_empty(ImgCompareState *s,
+                                                BlockBackend *blk,
+                                                const char *filename,
+                                                int64_t offset, int64_t bytes,
+                                                uint8_t *buf)
+{
+    int64_t idx;
+
+    if (compare_co_read(s, blk, filename, offset, bytes, buf) < 0) {
+        return;
+    }
+    idx = find_nonzero(buf, bytes);
     if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
-        return 1;
+        compare_fail(s, offset + idx, 1, false,
+                     "Content mismatch at offset %" PRId64 "!\n",
+                     offset + idx);
     }
+}
 
-    return 0;
+static void coroutine_fn compare_co_data(ImgCompareState *s, int64_t offset,
+                                         int64_t bytes, uint8_t *buf1,
+                                         uint8_t *buf2)
+{
+    int64_t pnum;
+    int ret;
+
+    if (compare_co_read(s, s->blk1, s->filename1, offset, bytes, buf1) < 0 ||
+        compare_co_read(s, s->blk2, s->filename2, offset, bytes, buf2) < 0) {
+        return;
+    }
+
+    ret = compare_buffers(buf1, buf2, bytes, &pnum);
+    if (ret || pnum != bytes) {
+        offset += ret ? 0 : pnum;
+        compare_fail(s, offset, 1, false,
+                     "Content mismatch at offset %" PRId64 "!\n", offset);
+    }
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    while (1) {
+        int64_t offset, bytes;
+        int action;
+
+        /* Querying the block status may yield, so take the lock to hand out
+         * areas in order */
+        qemu_co_mutex_lock(&s->lock);
+        if (s->offset >= s->progress_base || s->offset >= s->fail_offset) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+        action = compare_iteration(s, offset, &bytes);
+        if (action < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        s->offset += bytes;
+        qemu_co_mutex_unlock(&s->lock);
+
+        switch (action) {
+        case COMPARE_SKIP:
+            break;
+        case COMPARE_DATA:
+            compare_co_data(s, offset, bytes, buf1, buf2);
+            break;
+        case COMPARE_EMPTY1:
+            compare_co_check_empty(s, s->blk1, s->filename1, offset, bytes,
+                                   buf1);
+            break;
+        case COMPARE_EMPTY2:
+            compare_co_check_empty(s, s->blk2, s->filename2, offset, bytes,
+                                   buf2);
+            break;
+        default:
+            abort();
+        }
+
+        qemu_progress_print(((float) bytes / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
 }
 
 /*
@@ -1235,22 +1464,16 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
-    int c;
-    uint64_t progress_base;
+    int c, i;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1261,7 +1484,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsUm:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1297,6 +1520,15 @@ static int img_compare(int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = 2;
+                goto out4;
+            }
+            break;
         case OPTION_OBJECT: {
             QemuOpts *opts;
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
@@ -1355,11 +1587,6 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1374,8 +1601,6 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
-    progress_base = MAX(total_size1, total_size2);
 
     qemu_progress_print(0, 100);
 
@@ -1385,131 +1610,46 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    s = (ImgCompareState) {
+        .blk1           = blk1,
+        .blk2           = blk2,
+        .filename1      = filename1,
+        .filename2      = filename2,
+        .total_size1    = total_size1,
+        .total_size2    = total_size2,
+        .total_size     = MIN(total_size1, total_size2),
+        .progress_base  = MAX(total_size1, total_size2),
+        .strict         = strict,
+        .quiet          = quiet,
+        .fail_offset    = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
-        } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
-        }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
-
+    if (total_size1 != total_size2 && s.fail_offset >= s.total_size) {
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
+    }
+    if (s.fail_msg) {
+        if (s.fail_is_error) {
+            error_report("%s", s.fail_msg);
         } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
-
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+            qprintf(quiet, "%s", s.fail_msg);
         }
+        g_free(s.fail_msg);
+        ret = s.fail_ret;
+        goto out;
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1525,8 +1665,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
-
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1543,6 +1681,7 @@ typedef struct ImgConvertState {
     bool compressed;
     bool target_has_backing;
     bool wr_in_order;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
@@ -1667,6 +1806,41 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+/* Copies allocated data without reading it into a buffer, see
+ * blk_co_copy_range() */
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(blk,
+                                (sector_num - src_cur_offset)
+                                << BDRV_SECTOR_BITS,
+                                s->target, sector_num << BDRV_SECTOR_BITS,
+                                n << BDRV_SECTOR_BITS, 0, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
 
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
@@ -1758,6 +1932,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
+        bool copy_range;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1787,7 +1962,10 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
-        if (status == BLK_DATA) {
+        /* Offloaded copies happen in the write phase, so that they keep the
+         * order of writes if necessary */
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading sector %" PRId64
@@ -1808,7 +1986,25 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
             s->wait_sector_num[index] = -1;
         }
 
-        if (s->ret == -EINPROGRESS) {
+        if (copy_range && s->ret == -EINPROGRESS) {
+            ret = convert_co_copy_range(s, sector_num, n);
+            if (ret < 0) {
+                /* Copy this part through the buffer instead, and stop trying
+                 * if offloading is not supported at all */
+                if (ret == -ENOTSUP) {
+                    s->copy_range = false;
+                }
+                copy_range = false;
+                ret = convert_co_read(s, sector_num, n, buf);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    s->ret = ret;
+                }
+            }
+        }
+
+        if (!copy_range && s->ret == -EINPROGRESS) {
             ret = convert_co_write(s, sector_num, n, buf, status);
             if (ret < 0) {
                 error_report("error while writing sector %" PRId64
@@ -1946,7 +2142,7 @@ static int img_convert(int argc, char **argv)
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:O:B:co:s:l:S:pt:T:qnm:WU",
+        c = getopt_long(argc, argv, ":hf:O:B:Cco:s:l:S:pt:T:qnm:WU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1973,6 +2169,9 @@ static int img_convert(int argc, char **argv)
         case 'c':
             s.compressed = true;
             break;
+        case 'C':
+            s.copy_range = true;
+            break;
         case 'o':
             if (!is_valid_option_list(optarg)) {
                 error_report("Invalid option list: %s", optarg);
@@ -2072,8 +2271,8 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
-    if (!s.wr_in_order && s.compressed) {
-        error_report("Out of order write and compress are mutually exclusive");
+    if (s.copy_range && s.compressed) {
+        error_report("Copy offloading and compress are mutually exclusive");
         goto fail_getopt;
     }
 
@@ -15,6 +15,7 @@
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
+#include "qemu/bswap.h"
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -29,7 +30,7 @@ FILE *replay_file;
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        replay_log_write(&byte, 1);
     }
 }
 
@@ -42,77 +43,87 @@ void replay_put_event(uint8_t event)
 
 void replay_put_word(uint16_t word)
 {
-    replay_put_byte(word >> 8);
-    replay_put_byte(word);
+    if (replay_file) {
+        uint8_t buf[sizeof(word)];
+
+        stw_be_p(buf, word);
+        replay_log_write(buf, sizeof(buf));
+    }
 }
 
 void replay_put_dword(uint32_t dword)
 {
-    replay_put_word(dword >> 16);
-    replay_put_word(dword);
+    if (replay_file) {
+        uint8_t buf[sizeof(dword)];
+
+        stl_be_p(buf, dword);
+        replay_log_write(buf, sizeof(buf));
+    }
 }
 
 void replay_put_qword(int64_t qword)
 {
-    replay_put_dword(qword >> 32);
-    replay_put_dword(qword);
+    if (replay_file) {
+        uint8_t buf[sizeof(qword)];
+
+        stq_be_p(buf, qword);
+        replay_log_write(buf, sizeof(buf));
+    }
 }
 
 void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        replay_log_write(buf, size);
     }
 }
 
 uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
-    if (replay_file) {
-        byte = getc(replay_file);
+    if (replay_file && replay_log_read(&byte, 1) != 1) {
+        /* same as getc() at the end of the file */
+        byte = EOF;
     }
     return byte;
 }
 
 uint16_t replay_get_word(void)
 {
-    uint16_t word = 0;
+    uint8_t buf[sizeof(uint16_t)] = { 0 };
     if (replay_file) {
-        word = replay_get_byte();
-        word = (word << 8) + replay_get_byte();
+        replay_log_read(buf, sizeof(buf));
     }
 
-    return word;
+    return lduw_be_p(buf);
 }
 
 uint32_t replay_get_dword(void)
 {
-    uint32_t dword = 0;
+    uint8_t buf[sizeof(uint32_t)] = { 0 };
     if (replay_file) {
-        dword = replay_get_word();
-        dword = (dword << 16) + replay_get_word();
+        replay_log_read(buf, sizeof(buf));
     }
 
-    return dword;
+    return ldl_be_p(buf);
 }
 
 int64_t replay_get_qword(void)
 {
-    int64_t qword = 0;
+    uint8_t buf[sizeof(int64_t)] = { 0 };
     if (replay_file) {
-        qword = replay_get_dword();
-        qword = (qword << 32) + replay_get_dword();
+        replay_log_read(buf, sizeof(buf));
     }
 
-    return qword;
+    return ldq_be_p(buf);
 }
 
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (replay_log_read(buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -123,7 +134,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (replay_log_read(*buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -132,14 +143,14 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
-            error_report("replay file is over");
-            qemu_system_vmstop_request_prepare();
-            qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        if (replay_log_error()) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
+        } else if (replay_log_eof()) {
+            error_report("replay file is over");
+            qemu_system_vmstop_request_prepare();
+            qemu_system_vmstop_request(RUN_STATE_PAUSED);
         }
     }
 }
@@ -84,6 +84,27 @@ extern ReplayState replay_state;
 /* File for replay writing */
 extern FILE *replay_file;
 
+/* Buffered log I/O */
+
+/*! Starts buffered I/O on the log payload at the current file position.
+    For replay, the block index is read from the file. */
+void replay_log_open(FILE *file, ReplayMode mode);
+/*! Flushes pending blocks and stops the log worker thread. */
+void replay_log_close(void);
+/*! Appends data to the log. */
+void replay_log_write(const uint8_t *buf, size_t size);
+/*! Reads data from the log.
+    \return number of bytes read, less than size at the end of the log */
+size_t replay_log_read(uint8_t *buf, size_t size);
+/*! Returns the current offset in the uncompressed log. */
+uint64_t replay_log_tell(void);
+/*! Moves the replay position to an offset returned by replay_log_tell. */
+void replay_log_seek(uint64_t offset);
+/*! Returns true if a read went past the end of the log. */
+bool replay_log_eof(void);
+/*! Returns true if reading or writing the log file failed. */
+bool replay_log_error(void);
+
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
 void replay_put_word(uint16_t word);
@@ -178,6 +199,14 @@ void *replay_event_net_load(void);
 
 /* VMState-related functions */
 
+/*! Interval in seconds between snapshots taken while recording, 0 if none */
+extern uint64_t replay_snapshot_period;
+
+/*! Starts taking periodic snapshots while recording. */
+void replay_start_snapshot_timer(void);
+/*! Pauses the replay once icount instructions have been executed. */
+void replay_break(int64_t icount);
+
 /* Registers replay VMState.
    Should be called before virtual devices initialization
    to make cached timers available for post_load functions. */
@@ -0,0 +1,474 @@
+/*
+ * replay-log.c
+ *
+ * Buffered, compressed and asynchronous replay log I/O.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+#include <zlib.h>
+
+/*
+ * The log payload is stored as a sequence of blocks, each preceded by
+ * two big endian 32-bit words: the raw size and the stored size.  A block
+ * whose stored size equals its raw size is kept uncompressed, otherwise it
+ * is a zlib stream.
+ *
+ * While recording, events are appended to the current block with the
+ * replay mutex held.  Full blocks are handed to a worker thread which
+ * compresses and writes them, so the vCPU thread never waits for the
+ * file unless REPLAY_LOG_QUEUE_DEPTH blocks are already pending.
+ * While replaying, the worker reads and decompresses blocks ahead of
+ * the consumer.  Offsets reported by replay_log_tell() are positions in
+ * the uncompressed stream; an index of block offsets built when the log
+ * is opened lets replay_log_seek() restart from any of them.
+ */
+
+#define REPLAY_LOG_BLOCK_SIZE   (256 * 1024)
+#define REPLAY_LOG_QUEUE_DEPTH  4
+
+typedef struct ReplayLogBlock {
+    uint8_t *data;
+    size_t size;
+    /* offset of data[0] in the uncompressed stream */
+    uint64_t offset;
+    QSIMPLEQ_ENTRY(ReplayLogBlock) next;
+} ReplayLogBlock;
+
+typedef struct ReplayLogIndex {
+    uint64_t offset;
+    off_t file_pos;
+} ReplayLogIndex;
+
+typedef struct ReplayLog {
+    FILE *file;
+    ReplayMode mode;
+
+    /* Worker state, protected by lock */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, ReplayLogBlock) queue;
+    unsigned int queued;
+    bool running;
+    bool stop;
+    bool done;
+    bool error;
+    /* Next entry of index the reader fetches */
+    unsigned int next_block;
+
+    /* Consumer state, protected by the replay mutex */
+    ReplayLogBlock *cur;
+    size_t pos;
+    uint64_t offset;
+    bool eof;
+
+    /* Block index of a log opened for replay */
+    GArray *index;
+} ReplayLog;
+
+static ReplayLog replay_log;
+
+static ReplayLogBlock *replay_log_block_new(uint64_t offset)
+{
+    ReplayLogBlock *blk = g_new0(ReplayLogBlock, 1);
+
+    blk->data = g_malloc(REPLAY_LOG_BLOCK_SIZE);
+    blk->offset = offset;
+    return blk;
+}
+
+static void replay_log_block_free(ReplayLogBlock *blk)
+{
+    if (blk) {
+        g_free(blk->data);
+        g_free(blk);
+    }
+}
+
+static bool replay_log_write_block(ReplayLogBlock *blk, uint8_t *zbuf)
+{
+    uLongf zlen = compressBound(REPLAY_LOG_BLOCK_SIZE);
+    const uint8_t *out = zbuf;
+    uint32_t header[2];
+
+    if (compress2(zbuf, &zlen, blk->data, blk->size, Z_BEST_SPEED) != Z_OK
+        || zlen >= blk->size) {
+        out = blk->data;
+        zlen = blk->size;
+    }
+
+    header[0] = cpu_to_be32(blk->size);
+    header[1] = cpu_to_be32(zlen);
+    return fwrite(header, sizeof(header), 1, replay_log.file) == 1
+        && fwrite(out, 1, zlen, replay_log.file) == zlen;
+}
+
+static void *replay_log_writer(void *opaque)
+{
+    uint8_t *zbuf = g_malloc(compressBound(REPLAY_LOG_BLOCK_SIZE));
+    ReplayLogBlock *blk;
+    bool ok;
+
+    qemu_mutex_lock(&replay_log.lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&replay_log.queue) && !replay_log.stop) {
+            qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+        }
+        /* Pending blocks are always written before exiting */
+        blk = QSIMPLEQ_FIRST(&replay_log.queue);
+        if (!blk) {
+            break;
+        }
+        /* queued still counts the block until it is on disk */
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.queue, next);
+        qemu_mutex_unlock(&replay_log.lock);
+
+        ok = replay_log_write_block(blk, zbuf);
+        replay_log_block_free(blk);
+
+        qemu_mutex_lock(&replay_log.lock);
+        replay_log.queued--;
+        replay_log.error |= !ok;
+        qemu_cond_broadcast(&replay_log.cond);
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+
+    g_free(zbuf);
+    return NULL;
+}
+
+/* Reject headers that a writer with REPLAY_LOG_BLOCK_SIZE could not produce,
+ * so that a corrupted log cannot overflow the block buffer. */
+static bool replay_log_header_valid(uint32_t size, uint32_t zsize)
+{
+    return size <= REPLAY_LOG_BLOCK_SIZE
+        && zsize <= compressBound(REPLAY_LOG_BLOCK_SIZE);
+}
+
+static ReplayLogBlock *replay_log_read_block(const ReplayLogIndex *entry)
+{
+    ReplayLogBlock *blk;
+    uint32_t header[2];
+    uint32_t size, zsize;
+    uLongf len;
+    uint8_t *zbuf;
+    bool ok;
+
+    if (fseeko(replay_log.file, entry->file_pos, SEEK_SET) != 0
+        || fread(header, sizeof(header), 1, replay_log.file) != 1) {
+        return NULL;
+    }
+    size = be32_to_cpu(header[0]);
+    zsize = be32_to_cpu(header[1]);
+    if (!replay_log_header_valid(size, zsize)) {
+        return NULL;
+    }
+
+    blk = replay_log_block_new(entry->offset);
+    blk->size = size;
+    if (zsize == size) {
+        ok = fread(blk->data, 1, size, replay_log.file) == size;
+    } else {
+        zbuf = g_malloc(zsize);
+        len = size;
+        ok = fread(zbuf, 1, zsize, replay_log.file) == zsize
+            && uncompress(blk->data, &len, zbuf, zsize) == Z_OK
+            && len == size;
+        g_free(zbuf);
+    }
+
+    if (!ok) {
+        replay_log_block_free(blk);
+        return NULL;
+    }
+    return blk;
+}
+
+static void *replay_log_reader(void *opaque)
+{
+    ReplayLogIndex entry;
+    ReplayLogBlock *blk;
+
+    qemu_mutex_lock(&replay_log.lock);
+    while (!replay_log.stop) {
+        if (replay_log.queued >= REPLAY_LOG_QUEUE_DEPTH) {
+            qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+            continue;
+        }
+        if (replay_log.next_block >= replay_log.index->len) {
+            break;
+        }
+        entry = g_array_index(replay_log.index, ReplayLogIndex,
+                              replay_log.next_block++);
+        qemu_mutex_unlock(&replay_log.lock);
+
+        blk = replay_log_read_block(&entry);
+
+        qemu_mutex_lock(&replay_log.lock);
+        if (!blk) {
+            replay_log.error = true;
+            break;
+        }
+        QSIMPLEQ_INSERT_TAIL(&replay_log.queue, blk, next);
+        replay_log.queued++;
+        qemu_cond_broadcast(&replay_log.cond);
+    }
+    replay_log.done = true;
+    qemu_cond_broadcast(&replay_log.cond);
+    qemu_mutex_unlock(&replay_log.lock);
+
+    return NULL;
+}
+
+static void replay_log_start_worker(void)
+{
+    replay_log.stop = false;
+    replay_log.done = false;
+    replay_log.running = true;
+    qemu_thread_create(&replay_log.thread, "replay-log",
+                       replay_log.mode == REPLAY_MODE_RECORD
+                       ? replay_log_writer : replay_log_reader,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void replay_log_stop_worker(void)
+{
+    ReplayLogBlock *blk;
+
+    if (!replay_log.running) {
+        return;
+    }
+
+    qemu_mutex_lock(&replay_log.lock);
+    replay_log.stop = true;
+    qemu_cond_broadcast(&replay_log.cond);
+    qemu_mutex_unlock(&replay_log.lock);
+    qemu_thread_join(&replay_log.thread);
+    replay_log.running = false;
+
+    /* Only prefetched blocks can be left over */
+    while ((blk = QSIMPLEQ_FIRST(&replay_log.queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.queue, next);
+        replay_log_block_free(blk);
+    }
+    replay_log.queued = 0;
+}
+
+/* Scan the block headers once so that seeking does not require decoding.
+ * A block truncated by an interrupted recording is left out. */
+static void replay_log_build_index(void)
+{
+    ReplayLogIndex entry = { 0, ftello(replay_log.file) };
+    uint32_t header[2];
+    off_t next_pos;
+    struct stat st;
+
+    replay_log.index = g_array_new(false, false, sizeof(ReplayLogIndex));
+    if (fstat(fileno(replay_log.file), &st) < 0) {
+        return;
+    }
+    while (fread(header, sizeof(header), 1, replay_log.file) == 1) {
+        if (!replay_log_header_valid(be32_to_cpu(header[0]),
+                                     be32_to_cpu(header[1]))) {
+            error_report("Replay: invalid block header at offset %" PRId64
+                         " of the replay log", (int64_t)entry.file_pos);
+            exit(1);
+        }
+        next_pos = entry.file_pos + sizeof(header) + be32_to_cpu(header[1]);
+        if (next_pos > st.st_size
+            || fseeko(replay_log.file, next_pos, SEEK_SET) != 0) {
+            break;
+        }
+        g_array_append_val(replay_log.index, entry);
+        entry.offset += be32_to_cpu(header[0]);
+        entry.file_pos = next_pos;
+    }
+}
+
+void replay_log_open(FILE *file, ReplayMode mode)
+{
+    replay_log.file = file;
+    replay_log.mode = mode;
+    replay_log.cur = NULL;
+    replay_log.pos = 0;
+    replay_log.offset = 0;
+    replay_log.eof = false;
+    replay_log.error = false;
+    replay_log.next_block = 0;
+    QSIMPLEQ_INIT(&replay_log.queue);
+    qemu_mutex_init(&replay_log.lock);
+    qemu_cond_init(&replay_log.cond);
+
+    if (mode == REPLAY_MODE_PLAY) {
+        replay_log_build_index();
+    }
+    replay_log_start_worker();
+}
+
+static void replay_log_submit(void)
+{
+    qemu_mutex_lock(&replay_log.lock);
+    while (replay_log.queued >= REPLAY_LOG_QUEUE_DEPTH) {
+        qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&replay_log.queue, replay_log.cur, next);
+    replay_log.queued++;
+    qemu_cond_broadcast(&replay_log.cond);
+    qemu_mutex_unlock(&replay_log.lock);
+
+    replay_log.cur = NULL;
+}
+
+void replay_log_write(const uint8_t *buf, size_t size)
+{
+    size_t len;
+
+    while (size > 0) {
+        if (!replay_log.cur) {
+            replay_log.cur = replay_log_block_new(replay_log.offset);
+        }
+        len = MIN(size, REPLAY_LOG_BLOCK_SIZE - replay_log.cur->size);
+        memcpy(replay_log.cur->data + replay_log.cur->size, buf, len);
+        replay_log.cur->size += len;
+        replay_log.offset += len;
+        buf += len;
+        size -= len;
+
+        if (replay_log.cur->size == REPLAY_LOG_BLOCK_SIZE) {
+            replay_log_submit();
+        }
+    }
+}
+
+static bool replay_log_next_block(void)
+{
+    ReplayLogBlock *blk;
+
+    replay_log_block_free(replay_log.cur);
+    replay_log.cur = NULL;
+    replay_log.pos = 0;
+
+    qemu_mutex_lock(&replay_log.lock);
+    while (QSIMPLEQ_EMPTY(&replay_log.queue) && !replay_log.done) {
+        qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+    }
+    blk = QSIMPLEQ_FIRST(&replay_log.queue);
+    if (blk) {
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.queue, next);
+        replay_log.queued--;
+        qemu_cond_broadcast(&replay_log.cond);
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+
+    replay_log.cur = blk;
+    return blk != NULL;
+}
+
+size_t replay_log_read(uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    size_t len;
+
+    while (done < size) {
+        if (!replay_log.cur || replay_log.pos == replay_log.cur->size) {
+            if (!replay_log_next_block()) {
+                replay_log.eof = true;
+                break;
+            }
+        }
+        len = MIN(size - done, replay_log.cur->size - replay_log.pos);
+        memcpy(buf + done, replay_log.cur->data + replay_log.pos, len);
+        replay_log.pos += len;
+        replay_log.offset += len;
+        done += len;
+    }
+    return done;
+}
+
+uint64_t replay_log_tell(void)
+{
+    return replay_log.offset;
+}
+
+void replay_log_seek(uint64_t offset)
+{
+    ReplayLogIndex *entry;
+    unsigned int i;
+
+    if (replay_log.mode != REPLAY_MODE_PLAY) {
+        return;
+    }
+
+    replay_log_stop_worker();
+    replay_log_block_free(replay_log.cur);
+    replay_log.cur = NULL;
+
+    /* Find the last block starting at or before offset */
+    for (i = replay_log.index->len; i > 1; i--) {
+        entry = &g_array_index(replay_log.index, ReplayLogIndex, i - 1);
+        if (entry->offset <= offset) {
+            break;
+        }
+    }
+    replay_log.next_block = i ? i - 1 : 0;
+    replay_log.eof = false;
+    replay_log.error = false;
+    replay_log_start_worker();
+
+    if (replay_log_next_block()
+        && offset - replay_log.cur->offset <= replay_log.cur->size) {
+        replay_log.pos = offset - replay_log.cur->offset;
+        replay_log.offset = offset;
+    } else {
+        replay_log.eof = true;
+    }
+}
+
+bool replay_log_eof(void)
+{
+    return replay_log.eof;
+}
+
+bool replay_log_error(void)
+{
+    bool error;
+
+    qemu_mutex_lock(&replay_log.lock);
+    error = replay_log.error;
+    qemu_mutex_unlock(&replay_log.lock);
+
+    return error;
+}
+
+void replay_log_close(void)
+{
+    if (replay_log.mode == REPLAY_MODE_RECORD && replay_log.cur) {
+        replay_log_submit();
+    }
+    replay_log_stop_worker();
+
+    replay_log_block_free(replay_log.cur);
+    replay_log.cur = NULL;
+    if (replay_log.index) {
+        g_array_free(replay_log.index, true);
+        replay_log.index = NULL;
+    }
+    qemu_cond_destroy(&replay_log.cond);
+    qemu_mutex_destroy(&replay_log.lock);
+
+    if (replay_log.mode == REPLAY_MODE_RECORD && replay_log.error) {
+        error_report("replay log write error");
+    }
+    replay_log.file = NULL;
+}
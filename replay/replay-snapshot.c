@@ -20,11 +20,17 @@
 #include "qemu/error-report.h"
 #include "migration/vmstate.h"
 #include "migration/snapshot.h"
+#include "block/snapshot.h"
+#include "qemu/timer.h"
+#include "qemu/cutils.h"
+
+uint64_t replay_snapshot_period;
+static QEMUTimer *replay_snapshot_timer;
 
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
-    state->file_offset = ftell(replay_file);
+    state->file_offset = replay_log_tell();
 
     return 0;
 }
@@ -32,7 +38,7 @@ static int replay_pre_save(void *opaque)
 static int replay_post_load(void *opaque, int version_id)
 {
     ReplayState *state = opaque;
-    fseek(replay_file, state->file_offset, SEEK_SET);
+    replay_log_seek(state->file_offset);
     /* If this was a vmstate, saved in recording mode,
        we need to initialize replay data fields. */
     replay_fetch_data_kind();
@@ -83,3 +89,128 @@ void replay_vmstate_init(void)
         }
     }
 }
+
+/* Snapshots taken while recording are named <rrsnapshot>-<icount>.
+   Each one is a complete savevm: RAM is stored in full, while disk
+   contents are shared with the other internal snapshots. */
+static void replay_snapshot_timer_cb(void *opaque)
+{
+    static uint64_t last_step;
+    Error *err = NULL;
+    uint64_t step;
+    char *name;
+
+    step = replay_get_current_step();
+    /* An idle guest does not advance icount; saving again would only
+       rewrite the snapshot of the same name in full */
+    if (runstate_is_running() && step != last_step) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        name = g_strdup_printf("%s-%" PRIu64, replay_snapshot, step);
+        if (save_snapshot(name, &err) != 0) {
+            error_report_err(err);
+        } else {
+            last_step = step;
+        }
+        g_free(name);
+        vm_start();
+    }
+
+    timer_mod(replay_snapshot_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+              + replay_snapshot_period * 1000);
+}
+
+void replay_start_snapshot_timer(void)
+{
+    replay_snapshot_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                         replay_snapshot_timer_cb, NULL);
+    timer_mod(replay_snapshot_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+              + replay_snapshot_period * 1000);
+}
+
+/* Returns the name of the latest replay snapshot taken at or before icount,
+   the initial snapshot counting as instruction 0. */
+static char *replay_find_snapshot(int64_t icount, int64_t *snapshot_icount)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    QEMUSnapshotInfo *sn_tab = NULL;
+    size_t prefix = strlen(replay_snapshot);
+    char *res = NULL;
+    int64_t sn_icount;
+    int nb_sns, i;
+
+    *snapshot_icount = -1;
+    bs = bdrv_all_find_vmstate_bs();
+    if (!bs) {
+        return NULL;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    aio_context_release(aio_context);
+
+    for (i = 0; i < nb_sns; i++) {
+        const char *name = sn_tab[i].name;
+
+        if (strncmp(name, replay_snapshot, prefix)) {
+            continue;
+        }
+        if (name[prefix] == '\0') {
+            sn_icount = 0;
+        } else if (name[prefix] != '-'
+                   || qemu_strtoi64(name + prefix + 1, NULL, 10,
+                                    &sn_icount) < 0) {
+            continue;
+        }
+        if (sn_icount <= icount && sn_icount > *snapshot_icount) {
+            g_free(res);
+            res = g_strdup(name);
+            *snapshot_icount = sn_icount;
+        }
+    }
+    g_free(sn_tab);
+
+    return res;
+}
+
+void replay_seek(int64_t icount, Error **errp)
+{
+    int64_t snapshot_icount;
+    int64_t current;
+    char *name;
+
+    if (replay_mode != REPLAY_MODE_PLAY) {
+        error_setg(errp, "replay_seek is only available in replay mode");
+        return;
+    }
+    if (!replay_snapshot) {
+        error_setg(errp, "replay_seek requires the rrsnapshot option");
+        return;
+    }
+
+    vm_stop(RUN_STATE_PAUSED);
+
+    current = replay_get_current_step();
+    name = replay_find_snapshot(icount, &snapshot_icount);
+    /* Restore only when moving backwards or when a snapshot is closer
+       to the target than the current position */
+    if (icount < current || snapshot_icount > current) {
+        if (!name) {
+            error_setg(errp, "no replay snapshot before instruction %"
+                       PRId64, icount);
+            goto out;
+        }
+        if (load_snapshot(name, errp) != 0) {
+            goto out;
+        }
+    }
+
+    if (icount > (int64_t)replay_get_current_step()) {
+        replay_break(icount);
+        vm_start();
+    }
+
+out:
+    g_free(name);
+}
@@ -19,10 +19,11 @@
 #include "sysemu/cpus.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
+#include "qemu/bswap.h"
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02006
+#define REPLAY_VERSION              0xe02007
 /* Size of replay log header */
 #define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
 
@@ -34,6 +35,10 @@ static char *replay_filename;
 ReplayState replay_state;
 static GSList *replay_blockers;
 
+/* Instruction count at which replay is paused, or -1 */
+static int64_t replay_break_icount = -1;
+static QEMUBH *replay_break_bh;
+
 bool replay_next_event_is(int event)
 {
     bool res = false;
@@ -73,11 +78,33 @@ int replay_get_instructions(void)
     replay_mutex_lock();
     if (replay_next_event_is(EVENT_INSTRUCTION)) {
         res = replay_state.instructions_count;
+        if (replay_break_icount != -1) {
+            /* do not run past the break point */
+            res = MIN(res, MAX(replay_break_icount
+                               - (int64_t)replay_get_current_step(), 0));
+        }
     }
     replay_mutex_unlock();
     return res;
 }
 
+static void replay_break_bh_cb(void *opaque)
+{
+    vm_stop(RUN_STATE_PAUSED);
+}
+
+void replay_break(int64_t icount)
+{
+    assert(replay_mode == REPLAY_MODE_PLAY);
+
+    if (!replay_break_bh) {
+        replay_break_bh = qemu_bh_new(replay_break_bh_cb, NULL);
+    }
+    replay_mutex_lock();
+    replay_break_icount = icount;
+    replay_mutex_unlock();
+}
+
 void replay_account_executed_instructions(void)
 {
     if (replay_mode == REPLAY_MODE_PLAY) {
@@ -91,6 +118,11 @@ void replay_account_executed_instructions(void)
 
             replay_state.instructions_count -= count;
             replay_state.current_step += count;
+            if (replay_break_icount != -1
+                && (int64_t)replay_state.current_step >= replay_break_icount) {
+                replay_break_icount = -1;
+                qemu_bh_schedule(replay_break_bh);
+            }
             if (replay_state.instructions_count == 0) {
                 assert(replay_state.data_kind == EVENT_INSTRUCTION);
                 replay_finish_event();
@@ -252,14 +284,17 @@ static void replay_enable(const char *fname, int mode)
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_open(replay_file, replay_mode);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
+        uint32_t version = 0;
+        if (fread(&version, sizeof(version), 1, replay_file) != 1
+            || be32_to_cpu(version) != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
         /* go to the beginning */
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_log_open(replay_file, replay_mode);
         replay_fetch_data_kind();
     }
 
@@ -300,6 +335,11 @@ void replay_configure(QemuOpts *opts)
     }
 
     replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
+    replay_snapshot_period = qemu_opt_get_number(opts, "rrperiod", 0);
+    if (replay_snapshot_period && !replay_snapshot) {
+        error_report("rrperiod requires rrsnapshot");
+        exit(1);
+    }
     replay_vmstate_register();
     replay_enable(fname, mode);
 
@@ -322,7 +362,9 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
+    if (replay_mode == REPLAY_MODE_RECORD && replay_snapshot_period) {
+        replay_start_snapshot_timer();
+    }
 
     replay_enable_events();
 }
@@ -338,12 +380,19 @@ void replay_finish(void)
     /* finalize the file */
     if (replay_file) {
         if (replay_mode == REPLAY_MODE_RECORD) {
+            uint32_t version = cpu_to_be32(REPLAY_VERSION);
+
             /* write end event */
             replay_put_event(EVENT_END);
+            replay_log_close();
 
             /* write header */
             fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
+            if (fwrite(&version, sizeof(version), 1, replay_file) != 1) {
+                error_report("Replay: could not write log header");
+            }
+        } else {
+            replay_log_close();
         }
 
         fclose(replay_file);
@@ -909,6 +909,140 @@ static void hbitmap_test_add(const char *testpath,
                hbitmap_test_teardown);
 }
 
+/* Check hbitmap_next_zero against hbitmap_get, which also takes the
+ * granularity into account.
+ */
+static void hbitmap_test_check_next_zero(TestHBitmapData *data,
+                                         uint64_t start)
+{
+    int64_t ret = hbitmap_next_zero(data->hb, start, UINT64_MAX);
+    uint64_t i;
+
+    for (i = start; i < data->size; i++) {
+        if (!hbitmap_get(data->hb, i)) {
+            break;
+        }
+    }
+    if (i == data->size) {
+        g_assert_cmpint(ret, ==, -1);
+    } else {
+        g_assert_cmpint(ret, ==, i);
+    }
+
+    if (ret > 0 && ret > start) {
+        g_assert_cmpint(hbitmap_next_zero(data->hb, start, ret - start),
+                        ==, -1);
+    }
+}
+
+static void test_hbitmap_next_zero_do(TestHBitmapData *data, int granularity)
+{
+    static const uint64_t positions[] = {
+        0, 1, L1 - 1, L1, L1 + 1, 5 * L1 + 3, L2 - 1, L2, L2 + 7 * L1, L3 - 1,
+    };
+    int i;
+
+    hbitmap_test_init(data, L3, granularity);
+    for (i = 0; i < ARRAY_SIZE(positions); i++) {
+        hbitmap_test_check_next_zero(data, positions[i]);
+    }
+
+    hbitmap_test_set(data, 0, L2 + 3);
+    hbitmap_test_set(data, L2 + 7 * L1, 9 * L1);
+    for (i = 0; i < ARRAY_SIZE(positions); i++) {
+        hbitmap_test_check_next_zero(data, positions[i]);
+    }
+
+    hbitmap_test_set(data, 0, L3);
+    for (i = 0; i < ARRAY_SIZE(positions); i++) {
+        hbitmap_test_check_next_zero(data, positions[i]);
+    }
+
+    hbitmap_test_reset(data, L3 - 1, 1);
+    for (i = 0; i < ARRAY_SIZE(positions); i++) {
+        hbitmap_test_check_next_zero(data, positions[i]);
+    }
+}
+
+static void test_hbitmap_next_zero_0(TestHBitmapData *data,
+                                     const void *unused)
+{
+    test_hbitmap_next_zero_do(data, 0);
+}
+
+static void test_hbitmap_next_zero_4(TestHBitmapData *data,
+                                     const void *unused)
+{
+    test_hbitmap_next_zero_do(data, 4);
+}
+
+static void test_hbitmap_next_dirty_area(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L3, 0);
+
+    start = 0;
+    count = L3;
+    g_assert_false(hbitmap_next_dirty_area(data->hb, &start, &count));
+
+    hbitmap_test_set(data, L1 + 5, 3 * L1);
+    hbitmap_test_set(data, L2, 1);
+
+    start = 0;
+    count = L3;
+    g_assert_true(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L1 + 5);
+    g_assert_cmpint(count, ==, 3 * L1);
+
+    /* The area is clipped to the range that was passed in */
+    start = L1 + 10;
+    count = L1;
+    g_assert_true(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L1 + 10);
+    g_assert_cmpint(count, ==, L1);
+
+    start = 4 * L1 + 5;
+    count = L3;
+    g_assert_true(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L2);
+    g_assert_cmpint(count, ==, 1);
+
+    start = 4 * L1 + 5;
+    count = L2 - 4 * L1 - 5;
+    g_assert_false(hbitmap_next_dirty_area(data->hb, &start, &count));
+
+    start = L2 + 1;
+    count = L3;
+    g_assert_false(hbitmap_next_dirty_area(data->hb, &start, &count));
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3, 0);
+    b = hbitmap_alloc(L3, 0);
+
+    hbitmap_test_set(data, L1, 2 * L1);
+    hbitmap_test_set(data, L2 + 3, 1);
+    hbitmap_set(b, L1 + L1 / 2, 2 * L1);
+    hbitmap_set(b, L3 - 1, 1);
+    hbitmap_set(b, L2 + 3, 1);
+
+    g_assert_true(hbitmap_merge(data->hb, b));
+
+    /* Update the shadow bitmap to match */
+    hbitmap_test_set(data, L1 + L1 / 2, 2 * L1);
+    hbitmap_test_set(data, L3 - 1, 1);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 2 * L1 + L1 / 2 + 2);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(b);
+}
+
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
                                         const void *unused)
 {
@@ -985,6 +1119,14 @@ int main(int argc, char **argv)
 
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
+
+    hbitmap_test_add("/hbitmap/next_zero/next_zero_0",
+                     test_hbitmap_next_zero_0);
+    hbitmap_test_add("/hbitmap/next_zero/next_zero_4",
+                     test_hbitmap_next_zero_4);
+    hbitmap_test_add("/hbitmap/next_dirty_area",
+                     test_hbitmap_next_dirty_area);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
     g_test_run();
 
     return 0;
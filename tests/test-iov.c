@@ -404,6 +404,41 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_is_zero_range(void)
+{
+    struct iovec *iov;
+    unsigned int iov_cnt;
+    QEMUIOVector qiov;
+    size_t size, nonzero, offset, bytes;
+    unsigned int i;
+
+    iov_random(&iov, &iov_cnt);
+    for (i = 0; i < iov_cnt; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+    }
+    qemu_iovec_init_external(&qiov, iov, iov_cnt);
+    size = qiov.size;
+
+    g_assert(qemu_iovec_is_zero(&qiov));
+    g_assert(qemu_iovec_is_zero_range(&qiov, 0, size));
+
+    nonzero = g_test_rand_int_range(0, size);
+    iov_memset(iov, iov_cnt, nonzero, 1, 1);
+    g_assert(!qemu_iovec_is_zero(&qiov));
+
+    /* Every range is zero exactly if it does not contain the nonzero byte */
+    for (offset = 0; offset < size; offset++) {
+        for (bytes = 0; offset + bytes <= size; bytes++) {
+            bool expected = nonzero < offset || nonzero >= offset + bytes;
+
+            g_assert(qemu_iovec_is_zero_range(&qiov, offset, bytes) ==
+                     expected);
+        }
+    }
+
+    iov_free(iov, iov_cnt);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -412,5 +447,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/is-zero-range", test_is_zero_range);
     return g_test_run();
 }
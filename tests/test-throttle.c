@@ -667,6 +667,71 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_credit(void)
+{
+    ThrottleCredit credit;
+    ThrottleConfig cfg;
+    int64_t now;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000000;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 1000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    /* Use the time of the last leak so that the buckets do not leak */
+    now = ts.previous_leak;
+
+    /* Reads are only limited in bytes */
+    throttle_credit_take(&ts, false, now, &credit);
+    g_assert(double_cmp(credit.bytes, 10000));
+    g_assert(isinf(credit.units));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 10000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    throttle_credit_return(&ts, false, now, &credit);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 0));
+    g_assert(!throttle_credit_consume(&credit, 1, now));
+
+    /* Writes are limited in both, and the credit is accounted right away */
+    throttle_credit_take(&ts, true, now, &credit);
+    g_assert(double_cmp(credit.bytes, 10000));
+    g_assert(double_cmp(credit.units, 10));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 10));
+
+    g_assert(throttle_credit_consume(&credit, 4096, now));
+    g_assert(throttle_credit_consume(&credit, 4096, now));
+    g_assert(!throttle_credit_consume(&credit, 4096, now));
+    g_assert(double_cmp(credit.bytes, 10000 - 8192));
+    g_assert(double_cmp(credit.units, 8));
+
+    /* What is left is the same as accounting the requests that were done */
+    throttle_credit_return(&ts, true, now, &credit);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 8192));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 2));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 2));
+
+    /* No credit is handed out if it would cause throttling */
+    ts.cfg.buckets[THROTTLE_OPS_WRITE].level = 100;
+    throttle_credit_take(&ts, true, now, &credit);
+    g_assert(!throttle_credit_consume(&credit, 1, now));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 8192));
+
+    /* Credit leaks with the buckets: both limits leak 10ms worth of it */
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].level = 0;
+    ts.cfg.buckets[THROTTLE_OPS_TOTAL].level = 0;
+    ts.cfg.buckets[THROTTLE_OPS_WRITE].level = 0;
+    throttle_credit_take(&ts, true, now, &credit);
+    g_assert(throttle_credit_consume(&credit, 1, now + 9 * SCALE_MS));
+    g_assert(!throttle_credit_consume(&credit, 1, now + 10 * SCALE_MS));
+
+    /* Only the part that has not leaked yet is returned */
+    throttle_credit_return(&ts, true, now + 5 * SCALE_MS, &credit);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level,
+                        10000 - (10000 - 1) / 2.0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level,
+                        10 - (10 - 1) / 2.0));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -760,6 +825,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/credit",             test_credit);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -188,6 +188,101 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     }
 }
 
+/* Return the index of the first word in @words[pos..end) that is not all
+ * ones, or @end if there is none.  The unrolled loop lets the compiler
+ * check several words per instruction; dense bitmaps of large disks
+ * consist mostly of such words. */
+static size_t find_first_not_ones(const unsigned long *words, size_t pos,
+                                  size_t end)
+{
+    for (; pos + 4 <= end; pos += 4) {
+        if ((words[pos] & words[pos + 1] & words[pos + 2] &
+             words[pos + 3]) != ~0UL) {
+            break;
+        }
+    }
+    for (; pos < end; pos++) {
+        if (words[pos] != ~0UL) {
+            break;
+        }
+    }
+    return pos;
+}
+
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t first_bit, last_bit, res;
+    size_t pos, end_pos;
+    unsigned long cur;
+
+    if (count == 0) {
+        return -1;
+    }
+    first_bit = start >> hb->granularity;
+    if (first_bit >= hb->size) {
+        return -1;
+    }
+    if (count - 1 > UINT64_MAX - start) {
+        last_bit = hb->size - 1;
+    } else {
+        last_bit = MIN((start + count - 1) >> hb->granularity, hb->size - 1);
+    }
+
+    /* Look for zeroes by inverting the words; bits beyond hb->size are never
+     * set, so they show up as zeroes too, but they are beyond last_bit */
+    pos = first_bit >> BITS_PER_LEVEL;
+    end_pos = last_bit >> BITS_PER_LEVEL;
+    cur = ~last_lev[pos] & ~((1UL << (first_bit & (BITS_PER_LONG - 1))) - 1);
+    if (!cur && pos < end_pos) {
+        pos = find_first_not_ones(last_lev, pos + 1, end_pos + 1);
+        if (pos > end_pos) {
+            return -1;
+        }
+        cur = ~last_lev[pos];
+    }
+    if (!cur) {
+        return -1;
+    }
+
+    res = ((uint64_t)pos << BITS_PER_LEVEL) + ctzl(cur);
+    if (res > last_bit) {
+        return -1;
+    }
+
+    res <<= hb->granularity;
+    return MAX(res, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    HBitmapIter hbi;
+    uint64_t end, size = hb->size << hb->granularity;
+    int64_t first_dirty, first_zero;
+
+    if (*count == 0 || *start >= size) {
+        return false;
+    }
+    end = *count > size - *start ? size : *start + *count;
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    first_dirty = hbitmap_iter_next(&hbi);
+    if (first_dirty < 0 || first_dirty >= end) {
+        return false;
+    }
+    first_dirty = MAX(first_dirty, *start);
+
+    first_zero = hbitmap_next_zero(hb, first_dirty, end - first_dirty);
+    if (first_zero < 0) {
+        first_zero = end;
+    }
+
+    *start = first_dirty;
+    *count = first_zero - first_dirty;
+    return true;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -689,6 +784,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
+    HBitmapIter hbi;
+    unsigned long cur;
+    size_t pos;
     int i;
     uint64_t j;
 
@@ -700,11 +798,20 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* Only visit the nonzero words of B on the last level, which makes the
+     * merge cheap for the sparse bitmaps that are common in practice.  The
+     * upper levels are just 1/BITS_PER_LONG of the size, so merge them
+     * directly.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    hbitmap_iter_init(&hbi, b, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != (size_t)-1) {
+        unsigned long *word = &a->levels[HBITMAP_LEVELS - 1][pos];
+
+        a->count += ctpopl(cur & ~*word);
+        *word |= cur;
+    }
+
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
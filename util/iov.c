@@ -354,26 +354,38 @@ void qemu_iovec_concat(QEMUIOVector *dst,
 }
 
 /*
- * Check if the contents of the iovecs are all zero
+ * Check if @bytes bytes of the iovecs starting at @offset are all zero
  */
-bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+bool qemu_iovec_is_zero_range(QEMUIOVector *qiov, size_t offset, size_t bytes)
 {
     int i;
-    for (i = 0; i < qiov->niov; i++) {
-        size_t offs = QEMU_ALIGN_DOWN(qiov->iov[i].iov_len, 4 * sizeof(long));
-        uint8_t *ptr = qiov->iov[i].iov_base;
-        if (offs && !buffer_is_zero(qiov->iov[i].iov_base, offs)) {
-            return false;
+
+    for (i = 0; i < qiov->niov && bytes; i++) {
+        size_t len = qiov->iov[i].iov_len;
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
         }
-        for (; offs < qiov->iov[i].iov_len; offs++) {
-            if (ptr[offs]) {
-                return false;
-            }
+
+        len = MIN(len - offset, bytes);
+        if (!buffer_is_zero((uint8_t *)qiov->iov[i].iov_base + offset, len)) {
+            return false;
         }
+        bytes -= len;
+        offset = 0;
     }
     return true;
 }
 
+/*
+ * Check if the contents of the iovecs are all zero
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    return qemu_iovec_is_zero_range(qiov, 0, qiov->size);
+}
+
 void qemu_iovec_destroy(QEMUIOVector *qiov)
 {
     assert(qiov->nalloc != -1);
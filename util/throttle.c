@@ -23,11 +23,27 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
 #include "block/aio.h"
 
+/* Divisor applied to the average rate of a bucket to get the largest
+ * amount of credit that can be handed out at once, i.e. at most 10ms
+ * worth of I/O */
+#define THROTTLE_CREDIT_DIVISOR 100
+
+/* The buckets that are updated for each type of operation */
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
 /* This function make a bucket leak
  *
  * @bkt:   the bucket to make leak
@@ -87,6 +103,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute how many units a leaky bucket can hold before I/O is throttled
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +141,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -445,6 +473,48 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* compute the number of units that an operation counts for
+ *
+ * @op_size: the size of an operation in bytes, or 0
+ * @size:    the size of the operation
+ * @ret:     the unit count
+ */
+static double throttle_op_units(uint64_t op_size, uint64_t size)
+{
+    /* if op_size is defined and smaller than size we compute unit count */
+    if (op_size && size > op_size) {
+        return (double) size / op_size;
+    }
+
+    return 1.0;
+}
+
+/* add units to a leaky bucket
+ *
+ * @bkt:    the leaky bucket we operate on
+ * @amount: the number of units to add
+ */
+static void throttle_fill_bucket(LeakyBucket *bkt, double amount)
+{
+    bkt->level += amount;
+    if (bkt->burst_length > 1) {
+        bkt->burst_level += amount;
+    }
+}
+
+/* remove units that were added with throttle_fill_bucket() but not used
+ *
+ * @bkt:    the leaky bucket we operate on
+ * @amount: the number of units to remove
+ */
+static void throttle_unfill_bucket(LeakyBucket *bkt, double amount)
+{
+    bkt->level = MAX(bkt->level - amount, 0);
+    if (bkt->burst_length > 1) {
+        bkt->burst_level = MAX(bkt->burst_level - amount, 0);
+    }
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -452,39 +522,209 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
+    double units = throttle_op_units(ts->cfg.op_size, size);
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_size[is_write][i]],
+                             size);
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_units[is_write][i]],
+                             units);
+    }
+}
+
+/* compute how many units can be added to a leaky bucket before I/O has to
+ * be throttled
+ *
+ * @bkt: the leaky bucket we operate on, which must have a limit
+ * @ret: the number of units, or a value <= 0 if the bucket is full
+ */
+static double throttle_bucket_room(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size, room;
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+
+    room = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        room = MIN(room, burst_bucket_size - bkt->burst_level);
+    }
+
+    return room;
+}
+
+/* compute how much of a resource can be handed out at once
+ *
+ * @ts:       the throttle state we are working on
+ * @types:    the buckets that limit this resource
+ * @ret:      the amount, INFINITY if there is no limit or a value <= 0 if
+ *            the limit has been reached
+ */
+static double throttle_credit_batch(ThrottleState *ts,
+                                    const BucketType types[2])
+{
+    double batch = INFINITY;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt = &ts->cfg.buckets[types[i]];
+
+        if (bkt->avg) {
+            batch = MIN(batch, (double) bkt->avg / THROTTLE_CREDIT_DIVISOR);
+            batch = MIN(batch, throttle_bucket_room(bkt));
+        }
+    }
+
+    return batch;
+}
+
+/* compute how long the buckets take to leak an amount of a resource
+ *
+ * @ts:       the throttle state we are working on
+ * @types:    the buckets that limit this resource
+ * @amount:   the amount that was added to the buckets
+ * @ret:      the time in seconds, INFINITY if the buckets are not limited
+ */
+static double throttle_credit_lifetime(ThrottleState *ts,
+                                       const BucketType types[2],
+                                       double amount)
+{
+    double lifetime = INFINITY;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
+    if (!isfinite(amount)) {
+        return INFINITY;
     }
 
     for (i = 0; i < 2; i++) {
-        LeakyBucket *bkt;
+        LeakyBucket *bkt = &ts->cfg.buckets[types[i]];
 
-        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
-        bkt->level += size;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+        /* burst_level leaks faster than level */
+        if (bkt->avg) {
+            lifetime = MIN(lifetime, amount / (bkt->burst_length > 1 ?
+                                               bkt->max : bkt->avg));
         }
+    }
+
+    return lifetime;
+}
 
-        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
-        bkt->level += units;
-        if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+/* Hand out a batch of credit for operations of one type, that can then
+ * be spent with throttle_credit_consume() without touching @ts.
+ *
+ * The credit is accounted in the buckets right away, so it only covers
+ * I/O that could be done now without being throttled.  If the buckets
+ * are already full, @credit is left empty.  As the buckets leak, so does
+ * the credit: it expires once the buckets would have leaked all of it,
+ * so that it cannot be spent on top of I/O accounted later.
+ *
+ * @ts:       the throttle state we are working on
+ * @is_write: the type of operation (read/write)
+ * @now:      the current clock timestamp
+ * @credit:   the credit to fill, which must be empty
+ */
+void throttle_credit_take(ThrottleState *ts, bool is_write, int64_t now,
+                          ThrottleCredit *credit)
+{
+    double bytes, units, lifetime;
+    unsigned i;
+
+    /* leak proportionally to the time elapsed so the room is up to date */
+    throttle_do_leak(ts, now);
+
+    bytes = throttle_credit_batch(ts, bucket_types_size[is_write]);
+    units = throttle_credit_batch(ts, bucket_types_units[is_write]);
+
+    if (bytes <= 0 || units <= 0) {
+        *credit = (ThrottleCredit) { 0 };
+        return;
+    }
+
+    credit->bytes = bytes;
+    credit->units = units;
+    credit->op_size = ts->cfg.op_size;
+    credit->taken = now;
+
+    lifetime = MIN(throttle_credit_lifetime(ts, bucket_types_size[is_write],
+                                            bytes),
+                   throttle_credit_lifetime(ts, bucket_types_units[is_write],
+                                            units));
+    credit->expires = isfinite(lifetime)
+        ? now + (int64_t) (lifetime * NANOSECONDS_PER_SECOND) : INT64_MAX;
+
+    for (i = 0; i < 2; i++) {
+        if (isfinite(bytes)) {
+            throttle_fill_bucket(
+                &ts->cfg.buckets[bucket_types_size[is_write][i]], bytes);
+        }
+        if (isfinite(units)) {
+            throttle_fill_bucket(
+                &ts->cfg.buckets[bucket_types_units[is_write][i]], units);
         }
     }
 }
 
+/* Spend credit on an operation
+ *
+ * @credit: the credit we are working on
+ * @size:   the size of the operation
+ * @now:    the current clock timestamp
+ * @ret:    true if the credit covered the operation, false if it was left
+ *          untouched and the operation must be accounted in the normal way
+ */
+bool throttle_credit_consume(ThrottleCredit *credit, uint64_t size,
+                             int64_t now)
+{
+    double units = throttle_op_units(credit->op_size, size);
+
+    if (now >= credit->expires ||
+        credit->bytes < size || credit->units < units) {
+        return false;
+    }
+
+    credit->bytes -= size;
+    credit->units -= units;
+    return true;
+}
+
+/* Give back the credit that has been neither spent nor leaked, and empty
+ * @credit.
+ *
+ * @ts:       the throttle state the credit was taken from
+ * @is_write: the type of operation (read/write)
+ * @now:      the current clock timestamp
+ * @credit:   the credit to return
+ */
+void throttle_credit_return(ThrottleState *ts, bool is_write, int64_t now,
+                            ThrottleCredit *credit)
+{
+    double left = 1;
+    unsigned i;
+
+    /* The buckets leak the credit at a constant rate until it expires */
+    if (now >= credit->expires) {
+        left = 0;
+    } else if (credit->expires != INT64_MAX && now > credit->taken) {
+        left = (double) (credit->expires - now) /
+               (credit->expires - credit->taken);
+    }
+
+    for (i = 0; left > 0 && i < 2; i++) {
+        if (isfinite(credit->bytes)) {
+            throttle_unfill_bucket(
+                &ts->cfg.buckets[bucket_types_size[is_write][i]],
+                credit->bytes * left);
+        }
+        if (isfinite(credit->units)) {
+            throttle_unfill_bucket(
+                &ts->cfg.buckets[bucket_types_units[is_write][i]],
+                credit->units * left);
+        }
+    }
+
+    *credit = (ThrottleCredit) { 0 };
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
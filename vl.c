@@ -188,9 +188,6 @@ uint8_t *boot_splash_filedata;
 size_t boot_splash_filedata_size;
 uint8_t qemu_extra_params_fw[2];
 
-//default profiling parameters
-unsigned int profile_log_generic = 0;
-
 int icount_align_option;
 
 /* The bytes in qemu_uuid are in the order specified by RFC4122, _not_ in the
@@ -513,6 +510,9 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrsnapshot",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrperiod",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -3098,7 +3098,6 @@ static void register_global_properties(MachineState *ms)
 
 int main(int argc, char **argv, char **envp)
 {
-    char *opt_str;
     int i;
     int snapshot, linux_boot;
     const char *initrd_filename;
@@ -4215,25 +4214,7 @@ int main(int argc, char **argv, char **envp)
                 break;
             case QEMU_OPTION_profiling:
                 error_report("QEMU started with Profiling");
-                if (!optarg)
-                {
-                    //if no options are given all profiling functions are activated
-                    profile_log_generic = 1;
-                }
-                opt_str = (char*)malloc((strlen(optarg)+1) * sizeof(char));
-                strcpy(opt_str, optarg);
-                int i;
-                for (i = 0; i < strlen(opt_str); i++)
-                {
-                    char c = opt_str[i];
-                    switch (c) {
-                        case 'g':
-                            profile_log_generic = 1;
-                            error_report("Profile generic");
-                        default:
-                            break;
-                    }
-                }
+                profiler_parse_opts(optarg);
                 break;
             default:
                 os_parse_cmd_args(popt->index, optarg);